@@ -4,13 +4,47 @@
 #include <filesystem>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <locale.h>
 #include <chrono>
 #include <thread>
 #include <random>
 #include <fstream>
+#include <sstream>
+#include <numeric>
+#include <unordered_map>
+#include <unordered_set>
 #include <cstdlib>
+#include <csignal>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/resource.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <array>
+#include <map>
+#include <memory>
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -26,6 +60,19 @@ struct Settings {
     string icon_dirup;          // 3
     string icon_nowplaying;     // 19
     string icon_nowplaying_sel; // 45
+    bool scan_on_start;         // background scan of start_path
+    bool gapless;               // decode ahead, no gap between tracks
+    int buffer_ms;              // decoded audio queued ahead of the device
+    int output_profile;         // index into out_profiles
+    int prefetch_tracks;        // upcoming tracks kept in the page cache
+    int prefetch_mb;            // ... up to this many MB in total
+    bool normalize;             // level tracks to ReplayGain loudness
+    int eq_preset;              // index into eq_presets, 0=off
+    float eq_custom[10];        // band gains of the Custom preset, dB
+    int eq_preamp;              // dB
+    int crossfade_ms;           // overlap between consecutive tracks, 0=off
+    int crossfade_curve;        // index into fade_curves
+    bool spectrum;              // spectrum pane under the progress bar
 };
 static Settings settings = {
     {},      // start_path
@@ -36,18 +83,122 @@ static Settings settings = {
     false,   // reshuffle_on_end
     "/^/",   // icon_dirup
     "!-",    // icon_nowplaying
-    "!>"     // icon_nowplaying_sel
+    "!>",    // icon_nowplaying_sel
+    true,    // scan_on_start
+    true,    // gapless
+    500,     // buffer_ms
+    0,       // output_profile
+    3,       // prefetch_tracks
+    256,     // prefetch_mb
+    false,   // normalize
+    0,       // eq_preset
+    {},      // eq_custom
+    0,       // eq_preamp
+    0,       // crossfade_ms
+    0,       // crossfade_curve
+    false    // spectrum
 };
 
+// audio device setups. rate 0 follows each track's own rate, so nothing
+// gets resampled; buffer_ms 0 keeps the buffer setting
+struct OutProfile {
+    const char *name;
+    int    rate;
+    Uint16 fmt;
+    int    frames;      // device buffer
+    int    buffer_ms;
+};
+static const OutProfile out_profiles[] = {
+    { "Standard",    44100, MIX_DEFAULT_FORMAT, 2048, 0    },
+    { "Low Latency", 48000, MIX_DEFAULT_FORMAT, 256,  0    },
+    { "Low Power",   44100, MIX_DEFAULT_FORMAT, 8192, 2000 },
+    { "Native Rate", 0,     AUDIO_F32SYS,       2048, 0    },
+};
+static const int OUT_PROFILES = sizeof out_profiles / sizeof out_profiles[0];
+
+static const char *fade_curves[] = { "Equal Power", "Linear", "S-Curve" };
+static const int FADE_CURVES = sizeof fade_curves / sizeof fade_curves[0];
+
+// equalizer: peaking bands at octave centres, gains in dB. the last preset
+// takes its gains from settings.eq_custom
+static const int EQ_BANDS = 10;
+static const float eq_freqs[EQ_BANDS] = { 31, 62, 125, 250, 500, 1000, 2000, 4000, 8000, 16000 };
+struct EqPreset {
+    const char *name;
+    float db[EQ_BANDS];
+};
+static const EqPreset eq_presets[] = {
+    { "Off",          {} },
+    { "Flat",         {} },
+    { "Rock",         {  5,  3, -1, -3, -1,  2,  4,  5,  5,  5 } },
+    { "Pop",          { -1,  1,  3,  4,  3,  0, -1, -1, -1, -1 } },
+    { "Jazz",         {  3,  2,  1,  2, -1, -1,  0,  1,  2,  3 } },
+    { "Classical",    {  4,  3,  2,  1, -1, -1,  0,  2,  3,  4 } },
+    { "Bass Boost",   {  6,  5,  4,  2,  0,  0,  0,  0,  0,  0 } },
+    { "Treble Boost", {  0,  0,  0,  0,  0,  1,  2,  4,  5,  6 } },
+    { "Vocal",        { -2, -1,  0,  2,  4,  4,  3,  1,  0, -1 } },
+    { "Custom",       {} },
+};
+static const int EQ_PRESETS = sizeof eq_presets / sizeof eq_presets[0];
+// gains of the selected preset, null while the equalizer is off
+static const float *eq_gains(){
+    if(settings.eq_preset<=0) return nullptr;
+    return settings.eq_preset==EQ_PRESETS-1?settings.eq_custom:eq_presets[settings.eq_preset].db;
+}
+static string eq_custom_str(){
+    string s;
+    for(int i=0;i<EQ_BANDS;++i){
+        if(i) s+=',';
+        char b[16]; snprintf(b,sizeof b,"%g",settings.eq_custom[i]);
+        s+=b;
+    }
+    return s;
+}
+static void eq_custom_parse(const string &v){
+    size_t p=0;
+    for(int i=0;i<EQ_BANDS&&p<=v.size();++i){
+        settings.eq_custom[i]=clamp(strtof(v.c_str()+p,nullptr),-12.f,12.f);
+        size_t c=v.find(',',p);
+        if(c==string::npos) break;
+        p=c+1;
+    }
+}
+
 static mt19937 rng{ random_device{}() };
 
 // playback globals
-static vector<fs::path> playlist;
+static vector<uint32_t> playlist;   // path ids
 static vector<int>      order;
 static int              cur = -1;
+// inverse of order: playlist index -> position in order, plus path id ->
+// playlist index, so "[pos/total]" lookups are O(1) per row
+static vector<int>                  pl_pos;
+static unordered_map<uint32_t,int>  pl_index;
+static fs::path                     pl_dir;     // directory playlist came from
+static vector<int>                  pl_dur;     // per playlist index, ms, -1 unknown
+// pl_dur summed over order, kept up to date by everything that changes either
+static long                         pl_total_ms;
+static int                          pl_unknown;
+static int                          pl_settled;     // order positions fixed, see pl_settle
 
 // forward
+struct Entry;
+struct Library;
 void build_pl(const fs::path &f);
+void build_pl(uint32_t f,const vector<Entry> &listing);
+void build_pl(const Library &L,const uint32_t *rows,size_t n,size_t at);
+void pl_reorder(uint32_t now);
+void reindex_order();
+int  order_pos(uint32_t p);
+void pl_insert(uint32_t f);
+void pl_remove(uint32_t f);
+void pl_start();
+bool pl_append(uint32_t f,int dur_ms);
+void pl_set_dur(int k,int ms);
+void pl_settle(int n);
+int  pl_pick(int i);
+void meta_want(const fs::path &dir,int64_t mt,const vector<Entry> &v);
+void meta_post(const fs::path &dir,int64_t mt,const vector<Entry> &v);
 
 // load & save settings (dzk cgpt)
 void load_settings() {
@@ -67,6 +218,19 @@ void load_settings() {
         else if (key=="icon_dirup")      settings.icon_dirup = val;
         else if (key=="icon_nowplaying") settings.icon_nowplaying = val;
         else if (key=="icon_nowplaying_sel") settings.icon_nowplaying_sel = val;
+        else if (key=="scan_on_start")   settings.scan_on_start = (val=="1");
+        else if (key=="gapless")         settings.gapless = (val=="1");
+        else if (key=="buffer_ms")       settings.buffer_ms = max(50, stoi(val));
+        else if (key=="output")          settings.output_profile = min(max(0, stoi(val)), OUT_PROFILES-1);
+        else if (key=="prefetch")        settings.prefetch_tracks = max(0, stoi(val));
+        else if (key=="prefetch_mb")     settings.prefetch_mb = max(0, stoi(val));
+        else if (key=="normalize")       settings.normalize = (val=="1");
+        else if (key=="eq")              settings.eq_preset = min(max(0, stoi(val)), EQ_PRESETS-1);
+        else if (key=="eq_custom")       eq_custom_parse(val);
+        else if (key=="eq_preamp")       settings.eq_preamp = min(max(-12, stoi(val)), 12);
+        else if (key=="crossfade")       settings.crossfade_ms = max(0, stoi(val));
+        else if (key=="crossfade_curve") settings.crossfade_curve = min(max(0, stoi(val)), FADE_CURVES-1);
+        else if (key=="spectrum")        settings.spectrum = (val=="1");
     }
 }
 void save_settings() {
@@ -80,6 +244,19 @@ void save_settings() {
     out<<"icon_dirup="<<settings.icon_dirup<<"\n";
     out<<"icon_nowplaying="<<settings.icon_nowplaying<<"\n";
     out<<"icon_nowplaying_sel="<<settings.icon_nowplaying_sel<<"\n";
+    out<<"scan_on_start="<<(settings.scan_on_start?1:0)<<"\n";
+    out<<"gapless="<<(settings.gapless?1:0)<<"\n";
+    out<<"buffer_ms="<<settings.buffer_ms<<"\n";
+    out<<"output="<<settings.output_profile<<"\n";
+    out<<"prefetch="<<settings.prefetch_tracks<<"\n";
+    out<<"prefetch_mb="<<settings.prefetch_mb<<"\n";
+    out<<"normalize="<<(settings.normalize?1:0)<<"\n";
+    out<<"eq="<<settings.eq_preset<<"\n";
+    out<<"eq_custom="<<eq_custom_str()<<"\n";
+    out<<"eq_preamp="<<settings.eq_preamp<<"\n";
+    out<<"crossfade="<<settings.crossfade_ms<<"\n";
+    out<<"crossfade_curve="<<settings.crossfade_curve<<"\n";
+    out<<"spectrum="<<(settings.spectrum?1:0)<<"\n";
 }
 
 // help
@@ -169,6 +346,19 @@ bool settings_menu(){
             "Icon DirUp: "       + settings.icon_dirup,
             "Icon NowPlaying: "  + settings.icon_nowplaying,
             "Icon NowPlaySel: "  + settings.icon_nowplaying_sel,
+            string("Scan Library On Start: ") + (settings.scan_on_start?"On":"Off"),
+            string("Gapless Playback: ") + (settings.gapless?"On":"Off"),
+            "Buffer: " + to_string(settings.buffer_ms) + " ms",
+            string("Output Profile: ") + out_profiles[settings.output_profile].name,
+            "Prefetch Tracks: " + to_string(settings.prefetch_tracks),
+            "Prefetch Budget: " + to_string(settings.prefetch_mb) + " MB",
+            string("Normalize Loudness: ") + (settings.normalize?"On":"Off"),
+            string("Equalizer: ") + eq_presets[settings.eq_preset].name,
+            "EQ Custom Bands: " + eq_custom_str(),
+            "EQ Preamp: " + to_string(settings.eq_preamp) + " dB",
+            "Crossfade: " + (settings.crossfade_ms ? to_string(settings.crossfade_ms/1000) + " s" : string("Off")),
+            string("Crossfade Curve: ") + fade_curves[settings.crossfade_curve],
+            string("Spectrum: ") + (settings.spectrum?"On":"Off"),
             "Save & Return",
             "Quit",
             "Github (with manual): github.com/Szczebrzeszyniec/fmus",
@@ -220,18 +410,74 @@ bool settings_menu(){
             settings.icon_nowplaying_sel = modal_text_edit("New NowPlaySel Icon", settings.icon_nowplaying_sel);
             break;
         case 7:
+            settings.scan_on_start = !settings.scan_on_start;
+            break;
+        case 8:
+            settings.gapless = !settings.gapless;
+            break;
+        case 9: {
+            static const int steps[] = { 100, 250, 500, 1000, 2000 };
+            int i = 0;
+            while (i < 4 && steps[i] <= settings.buffer_ms) ++i;
+            settings.buffer_ms = steps[i] > settings.buffer_ms ? steps[i] : steps[0];
+            break;
+        }
+        case 10:
+            settings.output_profile = (settings.output_profile + 1) % OUT_PROFILES;
+            break;
+        case 11: {
+            static const int steps[] = { 0, 1, 2, 3, 5, 10 };
+            int i = 0;
+            while (i < 5 && steps[i] <= settings.prefetch_tracks) ++i;
+            settings.prefetch_tracks = steps[i] > settings.prefetch_tracks ? steps[i] : steps[0];
+            break;
+        }
+        case 12: {
+            static const int steps[] = { 64, 128, 256, 512, 1024, 2048 };
+            int i = 0;
+            while (i < 5 && steps[i] <= settings.prefetch_mb) ++i;
+            settings.prefetch_mb = steps[i] > settings.prefetch_mb ? steps[i] : steps[0];
+            break;
+        }
+        case 13:
+            settings.normalize = !settings.normalize;
+            break;
+        case 14:
+            settings.eq_preset = (settings.eq_preset + 1) % EQ_PRESETS;
+            break;
+        case 15:
+            eq_custom_parse(modal_text_edit("Band gains in dB, 31 Hz to 16 kHz", eq_custom_str()));
+            settings.eq_preset = EQ_PRESETS-1;
+            break;
+        case 16:
+            settings.eq_preamp = settings.eq_preamp >= 6 ? -12 : settings.eq_preamp + 3;
+            break;
+        case 17: {
+            static const int steps[] = { 0, 1000, 2000, 3000, 5000, 8000, 12000 };
+            int i = 0;
+            while (i < 6 && steps[i] <= settings.crossfade_ms) ++i;
+            settings.crossfade_ms = steps[i] > settings.crossfade_ms ? steps[i] : steps[0];
+            break;
+        }
+        case 18:
+            settings.crossfade_curve = (settings.crossfade_curve + 1) % FADE_CURVES;
+            break;
+        case 19:
+            settings.spectrum = !settings.spectrum;
+            break;
+        case 20:
             save_settings();
             return false;  // exit
-        case 8:
+        case 21:
             save_settings();
             return true;   // quit
-        case 9: {
+        case 22: {
             const char* url = "https://github.com/Szczebrzeszyniec/fmus";
             std::string cmd = std::string("xdg-open \"") + url + "\" &";
             system(cmd.c_str());
             break;
         }
-        case 10: {
+        case 23: {
             const char* url = "https://firepro.edu.pl/fmus";
             std::string cmd = std::string("xdg-open \"") + url + "\" &";
             system(cmd.c_str());
@@ -248,262 +494,4873 @@ bool settings_menu(){
 
 }
 
-// list items
-vector<fs::path> list_items(const fs::path &dir){
-    vector<fs::path> v;
-    static const vector<string> exts={
-      ".mp3",".wav",".flac",".ogg",".aac",
-      ".m4a",".wma",".alac",".aiff",".opus"
-    };
-    for(auto &e:fs::directory_iterator(dir)){
-        if(e.is_directory()) v.push_back(e.path());
-        else {
-            string ext=e.path().extension().string();
-            transform(ext.begin(),ext.end(),ext.begin(),::tolower);
-            if(find(exts.begin(),exts.end(),ext)!=exts.end())
-                v.push_back(e.path());
+// path pool
+// the queue and the listings hold paths as 32-bit ids: the parent's id plus
+// the last component, interned once, so equal paths have equal ids and a
+// queued track costs a few bytes. names go into 64 KB arena blocks and
+// records into fixed chunks; neither ever moves or is freed, so an id is
+// read without a lock and only interning takes pool.m
+static const uint32_t PATH_NONE = UINT32_MAX;  // the empty path
+struct PathRec { const char *name; uint32_t len, parent; };
+static struct PathPool {
+    static const int CHUNK_BITS = 14;
+    mutex                       m;
+    unique_ptr<PathRec[]>       chunk[1u<<(32-CHUNK_BITS)];
+    uint32_t                    n = 0;
+    vector<unique_ptr<char[]>>  arena;
+    char                       *at = nullptr;
+    size_t                      left = 0;
+    vector<uint32_t>            slot;   // open addressing, id+1, 0 is free
+} pool;
+
+static inline const PathRec &path_rec(uint32_t id){
+    return pool.chunk[id>>PathPool::CHUNK_BITS][id&((1u<<PathPool::CHUNK_BITS)-1)];
+}
+static inline size_t path_hash(uint32_t parent,string_view name){
+    return hash<string_view>()(name)^(parent*0x9e3779b97f4a7c15ull);
+}
+// id of `name` inside `parent`, interned on first sight
+static uint32_t path_child(uint32_t parent,string_view name){
+    PathPool &P=pool;
+    lock_guard<mutex> lk(P.m);
+    if(P.n*2>=P.slot.size()){
+        vector<uint32_t> s(max<size_t>(P.slot.size()*2,1<<12));
+        for(uint32_t i=0;i<P.n;++i){
+            const PathRec &r=path_rec(i);
+            size_t h=path_hash(r.parent,{r.name,r.len})&(s.size()-1);
+            while(s[h]) h=(h+1)&(s.size()-1);
+            s[h]=i+1;
         }
+        P.slot.swap(s);
     }
-    sort(v.begin(),v.end(),[](auto&a,auto&b){
-        bool da=fs::is_directory(a), db=fs::is_directory(b);
-        if(da!=db) return da>db;
-        return a.filename().wstring()<b.filename().wstring();
-    });
-    return v;
+    size_t mask=P.slot.size()-1, h=path_hash(parent,name)&mask;
+    for(;P.slot[h];h=(h+1)&mask){
+        const PathRec &r=path_rec(P.slot[h]-1);
+        if(r.parent==parent&&string_view(r.name,r.len)==name) return P.slot[h]-1;
+    }
+    if(name.size()>P.left){
+        P.left=max<size_t>(name.size(),1<<16);
+        P.arena.emplace_back(new char[P.left]);
+        P.at=P.arena.back().get();
+    }
+    memcpy(P.at,name.data(),name.size());
+    uint32_t id=P.n++;
+    auto &c=P.chunk[id>>PathPool::CHUNK_BITS];
+    if(!c) c.reset(new PathRec[1u<<PathPool::CHUNK_BITS]);
+    c[id&((1u<<PathPool::CHUNK_BITS)-1)]={ P.at, uint32_t(name.size()), parent };
+    P.at+=name.size(); P.left-=name.size();
+    P.slot[h]=id+1;
+    return id;
 }
-
-string fmt_time(int s){
-    int h=s/3600, m=(s%3600)/60, r=s%60;
-    char buf[16];
-    if(h>0) snprintf(buf,sizeof(buf),"%d:%02d:%02d",h,m,r);
-    else    snprintf(buf,sizeof(buf),"%02d:%02d",m,r);
-    return string(buf);
+// the root is an empty component, so joining with '/' puts it back
+static uint32_t path_id(string_view s){
+    uint32_t id=PATH_NONE;
+    if(!s.empty()&&s[0]=='/') id=path_child(PATH_NONE,"");
+    for(size_t i=0;i<s.size();){
+        size_t j=min(s.find('/',i),s.size());
+        if(j>i) id=path_child(id,s.substr(i,j-i));
+        i=j+1;
+    }
+    return id;
+}
+static fs::path path_of(uint32_t id){
+    if(id==PATH_NONE) return {};
+    size_t len=0;
+    for(uint32_t i=id;i!=PATH_NONE;i=path_rec(i).parent) len+=path_rec(i).len+1;
+    string s(len-1,'/');
+    for(uint32_t i=id;i!=PATH_NONE;i=path_rec(i).parent){
+        const PathRec &r=path_rec(i);
+        len-=r.len+1;
+        memcpy(&s[len],r.name,r.len);
+    }
+    return s.empty()?fs::path("/"):fs::path(std::move(s));
+}
+static inline string_view path_name(uint32_t id){
+    if(id==PATH_NONE) return {};
+    const PathRec &r=path_rec(id);
+    return { r.name, r.len };
+}
+static inline uint32_t path_parent(uint32_t id){
+    return id==PATH_NONE?PATH_NONE:path_rec(id).parent;
 }
 
-// playback callback
-static bool done_cb=false;
-static void music_done(){ done_cb=true; }
-
-int main(){
-    setlocale(LC_ALL,"");
-    load_settings();
-    register_help(":help","Show help");
-    register_help(":settings","Open settings");
-    register_help(":q","Quit");
-
-    initscr(); cbreak(); noecho(); keypad(stdscr,TRUE);
-    curs_set(0); timeout(10); mousemask(ALL_MOUSE_EVENTS,nullptr);
+// list items
+// everything sort and draw need is taken from the directory_iterator entry
+// once, so neither ever stats the file again
+struct Entry {
+    uint32_t      id;       // path, see path pool
+    fs::file_type type;
+    int           dur_ms = -1;  // -1 until known
+    float         gain_db = NAN;    // ReplayGain track gain, NaN until known
+    float         peak = 0;         // true peak, linear
+    string        title, artist, album;   // from the tags, see meta_read
+    int           track = 0, year = 0;
+    int64_t       added = 0;        // file mtime, seconds
+    int64_t       mtime_ns = 0;     // file stamp, see IdxEntry
+    uint64_t      size = 0;
+    bool          meta = false;     // tags have been read
+    bool dir() const { return type==fs::file_type::directory; }
+    fs::path    path() const { return path_of(id); }
+    string_view fname() const { return path_name(id); }
+};
+static Entry make_entry(uint32_t id, fs::file_type t){
+    Entry x{};
+    x.id=id; x.type=t;
+    return x;
+}
 
-    SDL_Init(SDL_INIT_AUDIO);
-    Mix_OpenAudio(44100,MIX_DEFAULT_FORMAT,2,2048);
-    Mix_HookMusicFinished(music_done);
+// library index
+// one file per directory under ~/.cache/fmus/dirs, named by a hash of the
+// path and laid out so it can be mmapped and read in place:
+//   IdxHeader, dir path bytes, IdxEntry[count], name bytes
+// entries are stored already sorted; a file is valid while the directory's
+// mtime matches, so revisiting a directory costs one stat. tag strings live
+// in the name bytes too. a stale file still seeds the rebuild: a track
+// whose size and mtime match its entry keeps its tags, duration and gain
+struct IdxHeader {
+    char     magic[4];      // "FMIX"
+    uint32_t version;
+    int64_t  mtime_ns;
+    uint32_t count;
+    uint32_t path_len;
+    uint32_t names_len;
+    uint32_t pad;
+};
+struct IdxEntry {
+    uint32_t name_off, name_len;
+    uint8_t  type;          // fs::file_type
+    uint8_t  meta;          // tags have been read
+    uint16_t track;
+    int32_t  dur_ms;
+    float    gain_db;       // NaN until analysed
+    float    peak;
+    uint32_t tag_off[3], tag_len[3];    // title, artist, album
+    uint16_t year, pad;
+    uint32_t added;         // file mtime, seconds
+    int64_t  mtime_ns;      // the file the values above were taken from,
+    uint64_t size;          // 0 until tags are read or it's measured
+};
+static const uint32_t IDX_VERSION = 5;
 
-    fs::path cwd = settings.start_path.empty()
-                      ? fs::path(getenv("HOME"))
-                      : settings.start_path;
-    auto items = list_items(cwd);
+static fs::path cache_dir(){
+    const char *x=getenv("XDG_CACHE_HOME");
+    fs::path base = (x&&*x) ? fs::path(x) : fs::path(getenv("HOME"))/".cache";
+    return base/"fmus";
+}
+static uint64_t fnv1a(const string &s){
+    uint64_t h=1469598103934665603ull;
+    for(unsigned char c:s){ h^=c; h*=1099511628211ull; }
+    return h;
+}
+static fs::path index_file(const fs::path &dir){
+    static const fs::path root=[]{
+        error_code ec; fs::create_directories(cache_dir()/"dirs",ec);
+        return cache_dir()/"dirs";
+    }();
+    char name[32];
+    snprintf(name,sizeof(name),"%016llx.idx",(unsigned long long)fnv1a(dir.native()));
+    return root/name;
+}
+// 0 when the directory can't be stat'ed
+static int64_t dir_mtime(const fs::path &dir){
+    struct stat st;
+    if(stat(dir.c_str(),&st)!=0||!S_ISDIR(st.st_mode)) return 0;
+    return int64_t(st.st_mtim.tv_sec)*1000000000+st.st_mtim.tv_nsec;
+}
+static bool file_stamp(const fs::path &f,int64_t &mtime,uint64_t &size){
+    struct stat st;
+    if(stat(f.c_str(),&st)!=0) return false;
+    mtime=int64_t(st.st_mtim.tv_sec)*1000000000+st.st_mtim.tv_nsec;
+    size=st.st_size;
+    return true;
+}
 
-    int sel = 0, off = 0;
-    Mix_Music *music = nullptr;
-    bool playing = false;
-    wstring cur_name;
-    auto start_t = chrono::steady_clock::now();
-    int track_len = 0, volume = 100;
-    if (settings.initial_volume_mode==0)      volume = settings.last_volume;
-    else if (settings.initial_volume_mode>0) volume = settings.initial_volume_mode;
-    Mix_VolumeMusic(volume*MIX_MAX_VOLUME/100);
+// read-only view of one mmapped index file, mtime -1 takes a stale one
+struct IdxMap {
+    const char *base=nullptr; size_t size=0;
+    const IdxHeader *hdr=nullptr;
+    const IdxEntry  *ents=nullptr;
+    const char      *names=nullptr;
+    IdxMap(const fs::path &dir,int64_t mtime){
+        int fd=open(index_file(dir).c_str(),O_RDONLY|O_CLOEXEC);
+        if(fd<0) return;
+        struct stat st;
+        if(fstat(fd,&st)==0&&st.st_size>=(off_t)sizeof(IdxHeader)){
+            void *m=mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+            if(m!=MAP_FAILED){ base=(const char*)m; size=st.st_size; }
+        }
+        close(fd);
+        if(!base) return;
+        auto h=(const IdxHeader*)base;
+        const string &dp=dir.native();
+        size_t need=sizeof(IdxHeader)+h->path_len
+                   +size_t(h->count)*sizeof(IdxEntry)+h->names_len;
+        if(memcmp(h->magic,"FMIX",4)||h->version!=IDX_VERSION
+           ||(mtime>=0&&h->mtime_ns!=mtime)||need!=size||h->path_len!=dp.size()
+           ||memcmp(base+sizeof(IdxHeader),dp.data(),dp.size())) return;
+        hdr=h;
+        ents=(const IdxEntry*)(base+sizeof(IdxHeader)+h->path_len);
+        names=(const char*)(ents+h->count);
+    }
+    ~IdxMap(){ if(base) munmap((void*)base,size); }
+    bool ok() const { return hdr!=nullptr; }
+};
 
-    bool cmd = false;
-    string cmdbuf;
-    update_size();
+// everything but the name and type
+static bool index_get(const IdxMap &m,const IdxEntry &e,Entry &x){
+    x.dur_ms=e.dur_ms;
+    x.gain_db=e.gain_db;
+    x.peak=e.peak;
+    x.meta=e.meta; x.track=e.track;
+    x.year=e.year; x.added=e.added;
+    x.mtime_ns=e.mtime_ns; x.size=e.size;
+    string *tag[3]={ &x.title, &x.artist, &x.album };
+    for(int k=0;k<3;++k){
+        if(size_t(e.tag_off[k])+e.tag_len[k]>m.hdr->names_len) return false;
+        tag[k]->assign(m.names+e.tag_off[k],e.tag_len[k]);
+    }
+    return true;
+}
+static bool index_load(const fs::path &dir,int64_t mtime,vector<Entry> &v){
+    IdxMap m(dir,mtime);
+    if(!m.ok()) return false;
+    v.clear(); v.reserve(m.hdr->count);
+    uint32_t d=path_id(dir.native());
+    for(uint32_t i=0;i<m.hdr->count;++i){
+        const IdxEntry &e=m.ents[i];
+        if(size_t(e.name_off)+e.name_len>m.hdr->names_len) return false;
+        v.push_back(make_entry(path_child(d,{m.names+e.name_off,e.name_len}),
+                               (fs::file_type)e.type));
+        if(!index_get(m,e,v.back())) return false;
+    }
+    return true;
+}
+// seed a fresh listing from the stale index: tracks that haven't changed
+// keep what was read and measured. the number carried over
+static size_t index_carry(const fs::path &dir,vector<Entry> &v){
+    IdxMap m(dir,-1);
+    if(!m.ok()) return 0;
+    unordered_map<string_view,const IdxEntry*> old;
+    for(uint32_t i=0;i<m.hdr->count;++i){
+        const IdxEntry &e=m.ents[i];
+        if(e.mtime_ns&&size_t(e.name_off)+e.name_len<=m.hdr->names_len)
+            old.emplace(string_view(m.names+e.name_off,e.name_len),&e);
+    }
+    size_t n=0;
+    for(Entry &x:v){
+        if(x.dir()) continue;
+        auto it=old.find(x.fname());
+        int64_t mt; uint64_t sz;
+        if(it==old.end()||!file_stamp(x.path(),mt,sz)) continue;
+        if(it->second->mtime_ns!=mt||it->second->size!=sz) continue;
+        Entry y=x;
+        if(index_get(m,*it->second,y)){ x=std::move(y); ++n; }
+    }
+    return n;
+}
 
-    auto set_time = [&](double p){
-        using sc = chrono::steady_clock;
-        start_t = sc::now()
-                - chrono::duration_cast<sc::duration>(
-                      chrono::duration<double>(p)
-                  );
-    };
-    auto playidx = [&](int i){
-        if (music) { Mix_HaltMusic(); Mix_FreeMusic(music); }
-        if (i<0 || i>=(int)order.size()) return;
-        music = Mix_LoadMUS(playlist[order[i]].string().c_str());
-        Mix_PlayMusic(music,1);
-        playing = true;
-        cur_name = playlist[order[i]].filename().wstring();
-        set_time(0.0);
-        track_len = int(Mix_MusicDuration(music));
-        cur = i;
-    };
-    auto next = [&](){
-        if (cur<0 || order.empty()) return;
-        if (settings.repeat_mode_default==2) {
-            playidx(cur);
-            return;
-        }
-        int n = cur + 1;
-        if (n >= (int)order.size()) {
-            if (settings.reshuffle_on_end) {
-                shuffle(order.begin(), order.end(), rng);
-                playidx(0);
-                return;
-            }
-            if (settings.repeat_mode_default==1) n = 0;
-            else { playing=false; Mix_HaltMusic(); return; }
+// bumped on every rewrite, so the library store can tell it's behind
+static atomic<unsigned> index_gen{0};
+// held by everything that writes an index, across whatever it read first:
+// a patch can't land in a file that a load/merge/store is about to replace
+static mutex index_m;
+static void index_store(const fs::path &dir,int64_t mtime,const vector<Entry> &v){
+    IdxHeader h{};
+    memcpy(h.magic,"FMIX",4);
+    h.version=IDX_VERSION; h.mtime_ns=mtime;
+    h.count=v.size(); h.path_len=dir.native().size();
+    vector<IdxEntry> ents(v.size());
+    string names;
+    for(size_t i=0;i<v.size();++i){
+        const Entry &x=v[i];
+        string_view n=x.fname();
+        ents[i]={ uint32_t(names.size()), uint32_t(n.size()),
+                  uint8_t(x.type), x.meta, uint16_t(min(max(x.track,0),65535)),
+                  x.dur_ms, x.gain_db, x.peak, {}, {},
+                  uint16_t(min(max(x.year,0),65535)), 0, uint32_t(max<int64_t>(x.added,0)),
+                  x.mtime_ns, x.size };
+        names+=n;
+        const string *tag[3]={ &x.title, &x.artist, &x.album };
+        for(int k=0;k<3;++k){
+            ents[i].tag_off[k]=names.size(); ents[i].tag_len[k]=tag[k]->size();
+            names+=*tag[k];
         }
-        playidx(n);
-    };
-    auto prev = [&](){
-        if (cur<0 || order.empty()) return;
-        if (settings.repeat_mode_default==2) {
-            playidx(cur);
-            return;
-        }
-        int p = cur - 1;
-        if (p < 0) {
-            if (settings.repeat_mode_default==1) p = order.size() - 1;
-            else return;
-        }
-        playidx(p);
-    };
-
-   auto draw = [&]() {
-    update_size();
-    clear();
+    }
+    h.names_len=names.size();
+    // write aside and rename so readers never map a half-written file
+    fs::path f=index_file(dir), tmp=f;
+    static atomic<unsigned> seq{0};
+    tmp+=".tmp"+to_string(getpid())+"."+to_string(seq++);
+    {
+        ofstream out(tmp,ios::binary|ios::trunc);
+        if(!out) return;
+        out.write((const char*)&h,sizeof h);
+        out.write(dir.native().data(),h.path_len);
+        out.write((const char*)ents.data(),ents.size()*sizeof(IdxEntry));
+        out.write(names.data(),names.size());
+        if(!out){ out.close(); unlink(tmp.c_str()); return; }
+    }
+    if(rename(tmp.c_str(),f.c_str())!=0) unlink(tmp.c_str());
+    else ++index_gen;
+}
 
-    // Build a virtual list first entry dirup
-    int total = items.size() + 1;
-    int vh    = rows - 4;
-    if (sel < off)          off = sel;
-    if (sel >= off + vh)    off = sel - vh + 1;
+// a track's entry in its directory's index, null if not indexed
+static const IdxEntry *index_find(const IdxMap &m,const fs::path &track){
+    if(!m.ok()) return nullptr;
+    // the name straight out of the path's own string, nothing temporary
+    string_view fn=track.native();
+    fn.remove_prefix(fn.rfind('/')+1);
+    for(uint32_t i=0;i<m.hdr->count;++i){
+        const IdxEntry &e=m.ents[i];
+        if(e.name_len==fn.size()&&!memcmp(m.names+e.name_off,fn.data(),fn.size())) return &e;
+    }
+    return nullptr;
+}
+// overwrite n bytes of the index file at what p points to in m
+static void index_patch(const fs::path &dir,const IdxMap &m,const void *p,const void *v,size_t n){
+    if(!memcmp(p,v,n)) return;
+    int fd=open(index_file(dir).c_str(),O_WRONLY|O_CLOEXEC);
+    if(fd<0) return;
+    ssize_t r=pwrite(fd,v,n,(const char*)p-m.base); (void)r;
+    close(fd);
+}
+// a value measured from the file as it is now: its stamp goes with it, so
+// the value survives the directory changing
+static void index_stamp(const fs::path &dir,const IdxMap &m,const IdxEntry *e,const fs::path &track){
+    int64_t st[2];
+    uint64_t sz;
+    static_assert(offsetof(IdxEntry,size)==offsetof(IdxEntry,mtime_ns)+sizeof(int64_t),"");
+    if(file_stamp(track,st[0],sz)){ st[1]=int64_t(sz); index_patch(dir,m,&e->mtime_ns,st,sizeof st); }
+}
+// patch one track's duration in place, keeps the file valid
+void index_note_duration(const fs::path &track,int ms){
+    fs::path dir=track.parent_path();
+    lock_guard<mutex> lk(index_m);
+    IdxMap m(dir,dir_mtime(dir));
+    if(const IdxEntry *e=index_find(m,track)){
+        index_patch(dir,m,&e->dur_ms,&ms,sizeof ms);
+        index_stamp(dir,m,e,track);
+    }
+}
+void index_note_gain(const fs::path &track,float gain_db,float peak){
+    fs::path dir=track.parent_path();
+    lock_guard<mutex> lk(index_m);
+    IdxMap m(dir,dir_mtime(dir));
+    float v[2]={ gain_db, peak };
+    static_assert(offsetof(IdxEntry,peak)==offsetof(IdxEntry,gain_db)+sizeof(float),"");
+    if(const IdxEntry *e=index_find(m,track)){
+        index_patch(dir,m,&e->gain_db,v,sizeof v);
+        index_stamp(dir,m,e,track);
+    }
+}
+// false until the track has been analysed; m is its directory's index
+static bool index_gain(const IdxMap &m,const fs::path &track,float &gain_db,float &peak){
+    const IdxEntry *e=index_find(m,track);
+    if(!e||isnan(e->gain_db)) return false;
+    gain_db=e->gain_db; peak=e->peak;
+    return true;
+}
+bool index_gain(const fs::path &track,float &gain_db,float &peak){
+    fs::path dir=track.parent_path();
+    return index_gain(IdxMap(dir,dir_mtime(dir)),track,gain_db,peak);
+}
 
-    // current playing
-    fs::path nowp;
-    if (music && cur >= 0) nowp = playlist[order[cur]];
+// seek index
+// tracks too big to decode whole are streamed by SDL_mixer, and seeking a
+// VBR MP3 or a FLAC without a seek table makes the decoder walk the file.
+// instead a background job records sample -> byte offset once a second
+// into ~/.cache/fmus/seek, and a seek reopens the stream at the nearest
+// frame: the file's header bytes (FLAC metadata) spliced in front of it
+struct SeekHeader {
+    char     magic[4];      // "FMSK"
+    uint32_t version;
+    int64_t  mtime_ns;
+    uint64_t size;
+    uint32_t rate, count;
+    uint64_t samples;
+    uint64_t head_len;      // bytes kept in front of a splice, 0 for mp3
+    uint32_t path_len;
+    uint32_t pad;
+};
+struct SeekPoint { uint64_t sample, offset; };
+struct SeekIndex {
+    uint32_t rate = 0;
+    uint64_t samples = 0, head_len = 0;
+    vector<SeekPoint> pts;
+};
+static const uint32_t SEEK_VERSION = 1;
 
-    for (int i = 0; i < vh && i + off < total; ++i) {
-        int idx = i + off;
-        bool hl = (idx == sel);
+static fs::path seek_file(const fs::path &track){
+    static const fs::path root=[]{
+        error_code ec; fs::create_directories(cache_dir()/"seek",ec);
+        return cache_dir()/"seek";
+    }();
+    char name[32];
+    snprintf(name,sizeof(name),"%016llx.idx",(unsigned long long)fnv1a(track.native()));
+    return root/name;
+}
 
-        const char* icon;
-        string      name;
+static bool seek_load(const fs::path &track,SeekIndex &x){
+    int64_t mt; uint64_t sz;
+    if(!file_stamp(track,mt,sz)) return false;
+    ifstream in(seek_file(track),ios::binary);
+    SeekHeader h;
+    if(!in.read((char*)&h,sizeof h)) return false;
+    const string &tp=track.native();
+    if(memcmp(h.magic,"FMSK",4)||h.version!=SEEK_VERSION||h.mtime_ns!=mt
+       ||h.size!=sz||h.path_len!=tp.size()||!h.rate||!h.count) return false;
+    string p(h.path_len,'\0');
+    if(!in.read(&p[0],p.size())||p!=tp) return false;
+    x.pts.resize(h.count);
+    if(!in.read((char*)x.pts.data(),x.pts.size()*sizeof(SeekPoint))) return false;
+    x.rate=h.rate; x.samples=h.samples; x.head_len=h.head_len;
+    return true;
+}
+static void seek_store(const fs::path &track,int64_t mtime,uint64_t size,const SeekIndex &x){
+    SeekHeader h{};
+    memcpy(h.magic,"FMSK",4);
+    h.version=SEEK_VERSION; h.mtime_ns=mtime; h.size=size;
+    h.rate=x.rate; h.count=x.pts.size(); h.samples=x.samples; h.head_len=x.head_len;
+    h.path_len=track.native().size();
+    fs::path f=seek_file(track), tmp=f;
+    tmp+=".tmp"+to_string(getpid());
+    {
+        ofstream out(tmp,ios::binary|ios::trunc);
+        if(!out) return;
+        out.write((const char*)&h,sizeof h);
+        out.write(track.native().data(),h.path_len);
+        out.write((const char*)x.pts.data(),x.pts.size()*sizeof(SeekPoint));
+        if(!out){ out.close(); unlink(tmp.c_str()); return; }
+    }
+    if(rename(tmp.c_str(),f.c_str())!=0) unlink(tmp.c_str());
+}
 
-        if (idx == 0) {
-            // dirup
-            icon = hl ? " > " : "   ";
-            name = settings.icon_dirup;
-        } else {
-            // file/dir
-            fs::path p = items[idx - 1];
-            bool isNow = (p == nowp);
-            if (isNow) {
-                icon = hl
-                   ? settings.icon_nowplaying_sel.c_str()
-                   : settings.icon_nowplaying.c_str();
-            } else {
-                icon = hl ? " > " : "   ";
+// sequential reader with a window, for walking multi-GB files
+struct FileScan {
+    int fd;
+    vector<uint8_t> buf = vector<uint8_t>(1<<20);
+    uint64_t base = 0;
+    size_t   len = 0;
+    // [off, off+n) or null past the end
+    const uint8_t *at(uint64_t off,size_t n){
+        if(off<base||off+n>base+len){
+            base=off; len=0;
+            while(len<buf.size()){
+                ssize_t r=pread(fd,&buf[len],buf.size()-len,off+len);
+                if(r<=0) break;
+                len+=r;
             }
-            name = p.filename().string()
-                 + (fs::is_directory(p) ? "/" : "");
+            if(len<n) return nullptr;
         }
+        return &buf[off-base];
+    }
+    uint64_t find(uint64_t off,uint8_t c){
+        while(const uint8_t *p=at(off,1)){
+            size_t avail=base+len-off;
+            if(auto q=(const uint8_t*)memchr(p,c,avail)) return off+(q-p);
+            off+=avail;
+        }
+        return UINT64_MAX;
+    }
+};
 
-        //icon draw
-        mvprintw(i+1, 0, "%s  ", icon);
-        mvprintw(i+1, 5, "%s", name.c_str());
-
-        // track pos
-        if (idx > 0) {
-            fs::path p = items[idx - 1];
-            auto it = find_if(order.begin(), order.end(),
-                [&](int o){ return playlist[o] == p; });
-            if (it != order.end()) {
-                int pos = int(it - order.begin());
-                string ind = "[" + to_string(pos+1)
-                           + "/" + to_string(order.size()) + "]";
-                mvprintw(i+1, cols - ind.size(), "%s", ind.c_str());
-            }
+// mp3 frame header: byte length, rate and samples; 0 if h isn't one
+static int mp3_frame(const uint8_t *h,int &rate,int &samples){
+    static const short kbps[5][16] = {
+        { 0,32,64,96,128,160,192,224,256,288,320,352,384,416,448 },   // v1 l1
+        { 0,32,48,56,64,80,96,112,128,160,192,224,256,320,384 },      // v1 l2
+        { 0,32,40,48,56,64,80,96,112,128,160,192,224,256,320 },       // v1 l3
+        { 0,32,48,56,64,80,96,112,128,144,160,176,192,224,256 },      // v2 l1
+        { 0,8,16,24,32,40,48,56,64,80,96,112,128,144,160 },           // v2 l2/l3
+    };
+    static const int rates[4][3] = {
+        { 11025, 12000, 8000 }, {}, { 22050, 24000, 16000 }, { 44100, 48000, 32000 } };
+    if(h[0]!=0xff||(h[1]&0xe0)!=0xe0) return 0;
+    int ver=(h[1]>>3)&3, layer=4-((h[1]>>1)&3), bi=h[2]>>4, si=(h[2]>>2)&3, pad=(h[2]>>1)&1;
+    if(ver==1||layer==4||bi==0||bi==15||si==3) return 0;
+    bool v1=(ver==3);
+    int br=kbps[v1?layer-1:(layer==1?3:4)][bi]*1000;
+    rate=rates[ver][si];
+    if(layer==1){ samples=384; return (12*br/rate+pad)*4; }
+    samples=(layer==3&&!v1)?576:1152;
+    return (samples/8)*br/rate+pad;
+}
+static bool seek_build_mp3(FileScan &fs_,SeekIndex &x){
+    uint64_t off=0;
+    if(const uint8_t *h=fs_.at(0,10); h&&!memcmp(h,"ID3",3)){
+        off=10+((h[6]&0x7f)<<21|(h[7]&0x7f)<<14|(h[8]&0x7f)<<7|(h[9]&0x7f));
+        if(h[5]&0x10) off+=10;
+    }
+    uint64_t samples=0, mark=0;
+    bool synced=false, first=true;
+    int rate, n;
+    while(const uint8_t *h=fs_.at(off,4)){
+        int len=mp3_frame(h,rate,n);
+        // after garbage, only trust a header that another one follows
+        const uint8_t *nx;
+        int r2, n2;
+        if(len&&!synced&&!((nx=fs_.at(off+len,4))&&mp3_frame(nx,r2,n2))) len=0;
+        if(!len){
+            synced=false;
+            uint64_t q=fs_.find(off+1,0xff);
+            if(q==UINT64_MAX) break;
+            off=q;
+            continue;
         }
+        synced=true;
+        // a Xing/Info frame carries no audio
+        const uint8_t *body=fs_.at(off,min(len,64));
+        bool info=first&&body&&(memmem(body,min(len,64),"Xing",4)||memmem(body,min(len,64),"Info",4));
+        first=false;
+        if(!info){
+            if(!x.rate) x.rate=rate;
+            if(samples>=mark){ x.pts.push_back({ samples, off }); mark+=x.rate; }
+            samples+=n;
         }
+        off+=len;
+    }
+    x.samples=samples;
+    return !x.pts.empty();
+}
 
-        // progress bar + status
-        if (music) {
-            double elapsed = playing
-                ? chrono::duration_cast<chrono::duration<double>>(
-                      chrono::steady_clock::now()-start_t
-                  ).count()
-                : Mix_GetMusicPosition(music);
-            int ie = min(track_len, int(elapsed));
-            int fill = cols
-                ? int((double)ie / track_len * cols + 0.5)
-                : 0;
-            int ybar = rows - 3;
-            for (int x = 0; x < cols; ++x)
-                mvaddch(ybar, x, x < fill ? ACS_CKBOARD : ' ');
+// what the mp3 walker can index: by extension, or an ID3v2 tag or two
+// chained frame headers right at the start. anything else would be walked
+// for sync look-alikes, and a splice at one of those is garbage
+static bool seek_is_mp3(const fs::path &f,FileScan &fs_){
+    string ext=f.extension().string();
+    transform(ext.begin(),ext.end(),ext.begin(),::tolower);
+    if(ext==".mp3"||ext==".mp2"||ext==".mp1") return true;
+    const uint8_t *h=fs_.at(0,10);
+    if(!h) return false;
+    if(!memcmp(h,"ID3",3)) return true;
+    int r, n, len=mp3_frame(h,r,n);
+    const uint8_t *nx;
+    return len&&(nx=fs_.at(len,4))&&mp3_frame(nx,r,n);
+}
 
-            string cur_t = fmt_time(ie),
-                   tot_t = fmt_time(track_len),
-                   mode  = "[" +
-                     string(settings.shuffle_default?"S":"-") +
-                     "|" +
-                     (settings.repeat_mode_default==0?"N":
-                      settings.repeat_mode_default==1?"D":"O")
-                     + "]";
-            string status = cur_t + "/" + tot_t + " " + mode;
-            if (!playing) status += " [pause]";
-
-            vector<char> buf(cur_name.size()*4+1);
-            wcstombs(buf.data(), cur_name.c_str(), buf.size());
-            string tname(buf.data());
-            int w = status.size(), av = cols - w - 1;
-            if ((int)tname.size() > av)
-                tname = tname.substr(0, av-3) + "...";
+static uint8_t crc8(const uint8_t *p,size_t n){
+    uint8_t c=0;
+    while(n--){ c^=*p++; for(int i=0;i<8;++i) c=(c&0x80)?uint8_t(c<<1^0x07):uint8_t(c<<1); }
+    return c;
+}
+static bool seek_build_flac(FileScan &fs_,SeekIndex &x){
+    const uint8_t *h=fs_.at(0,4);
+    if(!h||memcmp(h,"fLaC",4)) return false;
+    uint64_t off=4;
+    unsigned minblock=0;
+    while(true){    // metadata blocks; STREAMINFO comes first
+        if(!(h=fs_.at(off,4))) return false;
+        bool last=h[0]&0x80;
+        uint32_t len=h[1]<<16|h[2]<<8|h[3];
+        if((h[0]&0x7f)==0){
+            const uint8_t *d=fs_.at(off+4,18);
+            if(!d) return false;
+            minblock=d[0]<<8|d[1];
+            x.rate=d[10]<<12|d[11]<<4|d[12]>>4;
+            x.samples=uint64_t(d[13]&0x0f)<<32|uint32_t(d[14]<<24|d[15]<<16|d[16]<<8|d[17]);
+        }
+        off+=4+len;
+        if(last) break;
+    }
+    if(!x.rate) return false;
+    x.head_len=off;
+    uint64_t mark=0, prev=0;
+    bool any=false;
+    // frames have no length field, so walk sync codes and let the header
+    // CRC weed out look-alikes inside the audio
+    while((off=fs_.find(off,0xff))!=UINT64_MAX){
+        const uint8_t *f=fs_.at(off,16);
+        if(!f) break;
+        uint64_t at=off++;
+        if((f[1]&0xfe)!=0xf8||!(f[2]>>4)||(f[2]&0x0f)==15||(f[3]>>4)>10
+           ||((f[3]>>1)&7)==3||((f[3]>>1)&7)==7||(f[3]&1)) continue;
+        // utf-8 style coded frame or sample number
+        int extra=0; uint64_t num=f[4];
+        if(num>=0xfe){ extra=6; num=0; }
+        else if(num>=0x80){
+            while(num&(0x40>>extra)) ++extra;
+            if(!extra) continue;
+            num&=0x3f>>extra;
+        }
+        size_t p=5; bool bad=false;
+        for(int i=0;i<extra;++i,++p){
+            if((f[p]&0xc0)!=0x80){ bad=true; break; }
+            num=num<<6|(f[p]&0x3f);
+        }
+        if(bad) continue;
+        int bs=f[2]>>4, sr=f[2]&0x0f;
+        p+=(bs==6)+2*(bs==7)+(sr==12)+2*(sr==13||sr==14);
+        if(crc8(f,p)!=f[p]) continue;
+        uint64_t sample=(f[1]&1)?num:num*minblock;
+        if(any&&(sample<=prev||(x.samples&&sample>x.samples))) continue;
+        any=true; prev=sample;
+        if(sample>=mark){ x.pts.push_back({ sample, at }); mark=sample-sample%x.rate+x.rate; }
+    }
+    return !x.pts.empty();
+}
 
-            mvprintw(rows-2, 0, "%s", tname.c_str());
-            mvprintw(rows-2, cols - w, "%s", status.c_str());
-            mvprintw(rows-1, 0, "Vol: %d%%", volume);
+// builds and caches the index for f on a detached thread, one job per file
+static void seek_index_async(const fs::path &f){
+    static mutex m;
+    static set<string> busy;
+    {
+        lock_guard<mutex> lk(m);
+        if(!busy.insert(f.native()).second) return;
+    }
+    thread([f]{
+        int64_t mt; uint64_t sz;
+        int fd=open(f.c_str(),O_RDONLY|O_CLOEXEC);
+        if(fd>=0&&file_stamp(f,mt,sz)){
+            posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+            FileScan fs_{fd};
+            SeekIndex x;
+            bool ok=seek_build_flac(fs_,x);
+            if(!ok&&seek_is_mp3(f,fs_)){ x=SeekIndex{}; ok=seek_build_mp3(fs_,x); }
+            if(ok) seek_store(f,mt,sz,x);
         }
+        if(fd>=0) close(fd);
+        lock_guard<mutex> lk(m);
+        busy.erase(f.native());
+    }).detach();
+}
 
-        refresh();
-    };
+// SDL_RWops reading [0, head) of the file followed by [from, end)
+struct Splice { int fd; uint64_t head, from, size; int64_t pos; };
+static Sint64 splice_size(SDL_RWops *rw){ return ((Splice*)rw->hidden.unknown.data1)->size; }
+static Sint64 splice_seek(SDL_RWops *rw,Sint64 o,int whence){
+    Splice *s=(Splice*)rw->hidden.unknown.data1;
+    int64_t p=whence==RW_SEEK_SET?o:whence==RW_SEEK_CUR?s->pos+o:int64_t(s->size)+o;
+    if(p<0) return -1;
+    return s->pos=p;
+}
+static size_t splice_read(SDL_RWops *rw,void *dst,size_t size,size_t num){
+    Splice *s=(Splice*)rw->hidden.unknown.data1;
+    size_t want=size*num, got=0;
+    while(got<want&&uint64_t(s->pos)<s->size){
+        uint64_t p=s->pos, n=want-got, at;
+        if(p<s->head){ n=min<uint64_t>(n,s->head-p); at=p; }
+        else at=s->from+(p-s->head);
+        ssize_t r=pread(s->fd,(char*)dst+got,n,at);
+        if(r<=0) break;
+        got+=r; s->pos+=r;
+    }
+    return size?got/size:0;
+}
+static int splice_close(SDL_RWops *rw){
+    Splice *s=(Splice*)rw->hidden.unknown.data1;
+    close(s->fd); delete s;
+    SDL_FreeRW(rw);
+    return 0;
+}
+static SDL_RWops *splice_open(const fs::path &f,uint64_t head,uint64_t from){
+    int fd=open(f.c_str(),O_RDONLY|O_CLOEXEC);
+    struct stat st;
+    if(fd<0) return nullptr;
+    SDL_RWops *rw=fstat(fd,&st)==0&&uint64_t(st.st_size)>from?SDL_AllocRW():nullptr;
+    if(!rw){ close(fd); return nullptr; }
+    rw->hidden.unknown.data1=new Splice{ fd, head, from, head+(st.st_size-from), 0 };
+    rw->size=splice_size; rw->seek=splice_seek;
+    rw->read=splice_read; rw->write=nullptr; rw->close=splice_close;
+    rw->type=SDL_RWOPS_UNKNOWN;
+    return rw;
+}
 
-    draw();
+bool is_audio(const fs::path &p){
+    static const vector<string> exts={
+      ".mp3",".wav",".flac",".ogg",".aac",
+      ".m4a",".wma",".alac",".aiff",".opus"
+    };
+    string ext=p.extension().string();
+    transform(ext.begin(),ext.end(),ext.begin(),::tolower);
+    return find(exts.begin(),exts.end(),ext)!=exts.end();
+}
+// listing order: dirs first, then by name. UTF-8 bytes compare in code
+// point order, so the pool's names sort as they are
+bool entry_less(const Entry &a,const Entry &b){
+    if(a.dir()!=b.dir()) return a.dir();
+    return a.fname()<b.fname();
+}
 
-    while (true) {
-        int c = getch(), handled=0;
-        MEVENT me;
+// false for entries the browser doesn't show
+static bool dir_entry(const fs::directory_entry &e,uint32_t dir,Entry &out){
+    error_code ec;
+    // cached d_type, only symlinks/unknown cost a stat here
+    bool d=e.is_directory(ec);
+    if(!d&&!is_audio(e.path())) return false;
+    out=make_entry(path_child(dir,e.path().filename().native()),
+                   d?fs::file_type::directory:fs::file_type::regular);
+    return true;
+}
 
-        // dzk za nic gpt ssasz pałe huja dało
-if (!cmd && c == 9) {
-    timeout(-1);
+vector<Entry> list_items(const fs::path &dir){
+    vector<Entry> v;
+    int64_t mt=dir_mtime(dir);
+    if(mt&&index_load(dir,mt,v)){ meta_want(dir,mt,v); return v; }
+    v.clear();
+    Entry en;
+    uint32_t d=path_id(dir.native());
+    for(auto &e:fs::directory_iterator(dir))
+        if(dir_entry(e,d,en)) v.push_back(std::move(en));
+    sort(v.begin(),v.end(),entry_less);
+    if(mt){
+        lock_guard<mutex> lk(index_m);
+        index_carry(dir,v); index_store(dir,mt,v);
+    }
+    meta_want(dir,mt,v);
+    return v;
+}
 
-    if (settings_menu())
-        break;
+// async listing
+// the browser never reads a directory on the UI thread: a detached thread
+// per request streams entries back in batches and pokes list_fd. a job that
+// is still stuck on a dead mount just finishes into a cancelled object
+struct ListJob {
+    fs::path      dir;
+    atomic<bool>  cancel{false};
+    mutex         m;
+    vector<Entry> batch;    // not yet picked up by the UI
+    bool          done=false;
+};
+static int list_fd=-1;
+static void list_run(shared_ptr<ListJob> j){
+    auto post=[&](vector<Entry> &b,bool done){
+        {
+            lock_guard<mutex> lk(j->m);
+            move(b.begin(),b.end(),back_inserter(j->batch));
+            j->done=done;
+        }
+        b.clear();
+        uint64_t one=1;
+        ssize_t r=write(list_fd,&one,sizeof one); (void)r;
+    };
+    vector<Entry> all, b;
+    int64_t mt=dir_mtime(j->dir);
+    if(mt&&index_load(j->dir,mt,all)){
+        meta_want(j->dir,mt,all);
+        post(all,true);
+        return;
+    }
+    all.clear();
+    bool complete=false;
+    try {
+        Entry en;
+        uint32_t d=path_id(j->dir.native());
+        for(auto &e:fs::directory_iterator(j->dir)){
+            if(j->cancel) return;
+            if(!dir_entry(e,d,en)) continue;
+            all.push_back(en);
+            b.push_back(std::move(en));
+            if(b.size()>=256) post(b,false);
+        }
+        complete=true;
+    } catch(const fs::filesystem_error&) {}   // show whatever was readable
+    if(j->cancel) return;
+    post(b,true);
+    if(mt&&complete){
+        sort(all.begin(),all.end(),entry_less);
+        size_t carried;
+        {
+            lock_guard<mutex> lk(index_m);
+            carried=index_carry(j->dir,all);
+            index_store(j->dir,mt,all);
+        }
+        // what's carried over reaches the UI the way fresh tags do
+        if(carried) meta_post(j->dir,mt,all);
+        meta_want(j->dir,mt,all);
+    }
+}
+shared_ptr<ListJob> list_async(const fs::path &dir){
+    auto j=make_shared<ListJob>();
+    j->dir=dir;
+    thread(list_run,j).detach();
+    return j;
+}
 
-    update_size();
-    clear();
-    refresh();
+// tree queue
+// "play this folder" for a whole tree: a detached thread walks it depth
+// first in listing order and streams the tracks back through list_fd, so
+// the first ones play while the rest is still being found
+struct TreeJob {
+    fs::path      root;
+    atomic<bool>  cancel{false};
+    mutex         m;
+    vector<pair<uint32_t,int>> batch;   // path id, ms; not yet picked up
+    bool          done=false;
+};
+static void tree_walk(TreeJob &j,const fs::path &d,set<pair<dev_t,ino_t>> &seen){
+    struct stat st;
+    if(j.cancel||stat(d.c_str(),&st)) return;
+    if(!seen.insert({st.st_dev,st.st_ino}).second) return;     // symlink loop
+    vector<Entry> v;
+    try { v=list_items(d); } catch(const fs::filesystem_error&) { return; }
+    vector<pair<uint32_t,int>> b;
+    for(auto &e:v){
+        if(e.dir()) tree_walk(j,e.path(),seen);     // dirs sort first
+        else b.emplace_back(e.id,e.dur_ms);
+    }
+    if(b.empty()||j.cancel) return;
+    {
+        lock_guard<mutex> lk(j.m);
+        j.batch.insert(j.batch.end(),b.begin(),b.end());
+    }
+    uint64_t one=1;
+    ssize_t r=write(list_fd,&one,sizeof one); (void)r;
+}
+static void tree_run(shared_ptr<TreeJob> j){
+    set<pair<dev_t,ino_t>> seen;
+    tree_walk(*j,j->root,seen);
+    {
+        lock_guard<mutex> lk(j->m);
+        j->done=true;
+    }
+    uint64_t one=1;
+    ssize_t r=write(list_fd,&one,sizeof one); (void)r;
+}
+shared_ptr<TreeJob> tree_async(const fs::path &root){
+    auto j=make_shared<TreeJob>();
+    j->root=root;
+    thread(tree_run,j).detach();
+    return j;
+}
 
-    timeout(10);
+// library scan
+// walks a whole tree in the background, one task per directory. each worker
+// pops from the back of its own deque and steals from the front of the
+// others when it runs dry. listing goes through list_items(), which leaves an
+// index file behind for every directory, so the library fills as it goes
+struct ScanWorker { mutex m; deque<fs::path> q; };
+// one scan from start to finish; workers hold it, so a stopped run that is
+// stuck on a dead mount just finishes into an object nobody looks at
+struct ScanRun {
+    vector<unique_ptr<ScanWorker>> ws;
+    mutex              idle_m;
+    condition_variable idle_cv;
+    atomic<int>        queued{0}, pending{0};  // waiting / waiting+running
+    atomic<long>       dirs{0}, tracks{0};
+    atomic<bool>       stop{false}, active{true};
+    mutex              seen_m;
+    set<pair<dev_t,ino_t>> seen;               // symlink loops
+};
+static struct Scan {
+    shared_ptr<ScanRun> run;                   // latest, UI thread only
+    atomic<int64_t>    last_note{0};
+    int                fd = -1;                // eventfd, progress for the UI
+} scan;
 
-    draw();
-    continue;
+// wake the UI, at most every 100 ms unless forced
+static void scan_note(bool force){
+    int64_t now=chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+    if(!force&&now-scan.last_note<100) return;
+    scan.last_note=now;
+    uint64_t one=1;
+    ssize_t r=write(scan.fd,&one,sizeof one); (void)r;
+}
+static void scan_push(ScanRun &S,int i,fs::path d){
+    ++S.pending;
+    {
+        lock_guard<mutex> lk(S.ws[i]->m);
+        S.ws[i]->q.push_back(std::move(d));
+    }
+    ++S.queued;
+    { lock_guard<mutex> lk(S.idle_m); }
+    S.idle_cv.notify_one();
+}
+static bool scan_take(ScanRun &S,int i,fs::path &d){
+    int n=S.ws.size();
+    for(int k=0;k<n;++k){
+        ScanWorker &w=*S.ws[(i+k)%n];
+        lock_guard<mutex> lk(w.m);
+        if(w.q.empty()) continue;
+        // own work LIFO (depth first, warm dentries), stolen work FIFO
+        if(k==0){ d=std::move(w.q.back());  w.q.pop_back(); }
+        else    { d=std::move(w.q.front()); w.q.pop_front(); }
+        --S.queued;
+        return true;
+    }
+    return false;
+}
+static void scan_dir(ScanRun &S,int i,const fs::path &d){
+    struct stat st;
+    if(stat(d.c_str(),&st)!=0) return;
+    {
+        lock_guard<mutex> lk(S.seen_m);
+        if(!S.seen.insert({st.st_dev,st.st_ino}).second) return;
+    }
+    vector<Entry> v;
+    try { v=list_items(d); } catch(const fs::filesystem_error&) { return; }
+    long t=0;
+    for(auto &e:v){
+        if(S.stop) return;
+        if(e.dir()) scan_push(S,i,e.path());
+        else ++t;
+    }
+    S.tracks+=t;
+    ++S.dirs;
+    scan_note(false);
+}
+static void scan_worker(shared_ptr<ScanRun> run,int i){
+    ScanRun &S=*run;
+    fs::path d;
+    while(!S.stop){
+        if(!scan_take(S,i,d)){
+            unique_lock<mutex> lk(S.idle_m);
+            if(S.pending==0) break;
+            S.idle_cv.wait(lk,[&]{
+                return S.stop||S.queued>0||S.pending==0; });
+            continue;
+        }
+        scan_dir(S,i,d);
+        if(--S.pending==0){
+            S.active=false;
+            { lock_guard<mutex> lk(S.idle_m); }
+            S.idle_cv.notify_all();
+            scan_note(true);
+        }
+    }
+}
+// signals the workers and returns; one blocked in a directory read leaves
+// when the read does
+void scan_stop(){
+    if(!scan.run) return;
+    ScanRun &S=*scan.run;
+    S.stop=true; S.active=false;
+    { lock_guard<mutex> lk(S.idle_m); }
+    S.idle_cv.notify_all();
+}
+void scan_start(const fs::path &root){
+    scan_stop();
+    auto run=make_shared<ScanRun>();
+    // well past the core count, most of the time is spent waiting on I/O
+    int n=clamp(int(thread::hardware_concurrency())*2,4,32);
+    for(int i=0;i<n;++i) run->ws.push_back(make_unique<ScanWorker>());
+    scan_push(*run,0,root);
+    for(int i=0;i<n;++i) thread(scan_worker,run,i).detach();
+    scan.run=run;
+    scan_note(true);
 }
 
+// prefetch
+// keeps the next few tracks of the queue in the page cache so a track
+// change never waits on a cold spinning disk or network share. one thread
+// walks the plan and reads each file ahead with readahead(2), or plain
+// reads where that isn't supported, until the byte budget is spent. a new
+// plan (track change, reshuffle, new playlist) interrupts the current one
+static struct Prefetch {
+    mutex    m;
+    condition_variable cv;
+    vector<fs::path> plan;
+    uint64_t budget = 0;
+    unsigned gen = 0;
+    bool     quit = false;
+    thread   th;
+    unordered_map<string,uint64_t> warm;    // worker-only: bytes already read
+} pf;
 
+// false if a newer plan came in meanwhile
+static bool prefetch_file(const fs::path &f,uint64_t want,unsigned gen){
+    int fd=open(f.c_str(),O_RDONLY|O_CLOEXEC);
+    if(fd<0) return true;
+    posix_fadvise(fd,0,want,POSIX_FADV_WILLNEED);
+    const uint64_t step=4<<20;
+    vector<char> sink;
+    bool fresh=true;
+    for(uint64_t off=0;off<want&&fresh;off+=step){
+        size_t n=min(step,want-off);
+        if(readahead(fd,off,n)!=0){
+            // no readahead here (some FUSE mounts): read through instead
+            sink.resize(step);
+            if(pread(fd,sink.data(),n,off)<=0) break;
+        }
+        lock_guard<mutex> lk(pf.m);
+        fresh=(pf.gen==gen&&!pf.quit);
+    }
+    close(fd);
+    return fresh;
+}
+static void prefetch_worker(){
+    unique_lock<mutex> lk(pf.m);
+    unsigned done=0;
+    while(true){
+        pf.cv.wait(lk,[&]{ return pf.quit||pf.gen!=done; });
+        if(pf.quit) return;
+        done=pf.gen;
+        vector<fs::path> plan=pf.plan;
+        uint64_t left=pf.budget;
+        lk.unlock();
+        unordered_map<string,uint64_t> warm;
+        for(auto &f:plan){
+            error_code ec;
+            uint64_t want=min<uint64_t>(fs::file_size(f,ec),left);
+            if(ec||!want) continue;
+            auto it=pf.warm.find(f.native());
+            if(!(it!=pf.warm.end()&&it->second>=want)
+               &&!prefetch_file(f,want,done)) break;
+            warm[f.native()]=want;
+            left-=want;
+        }
+        // only what's still planned is remembered, the rest may be evicted
+        pf.warm.swap(warm);
+        lk.lock();
+    }
+}
+void prefetch(vector<fs::path> plan,uint64_t budget){
+    lock_guard<mutex> lk(pf.m);
+    if(plan==pf.plan&&budget==pf.budget) return;
+    pf.plan=std::move(plan); pf.budget=budget;
+    ++pf.gen;
+    if(!pf.th.joinable()) pf.th=thread(prefetch_worker);
+    pf.cv.notify_one();
+}
+void prefetch_stop(){
+    {
+        lock_guard<mutex> lk(pf.m);
+        pf.quit=true;
+        pf.cv.notify_one();
+    }
+    if(pf.th.joinable()) pf.th.join();
+}
 
+string fmt_time(int s){
+    int h=s/3600, m=(s%3600)/60, r=s%60;
+    char buf[16];
+    if(h>0) snprintf(buf,sizeof(buf),"%d:%02d:%02d",h,m,r);
+    else    snprintf(buf,sizeof(buf),"%02d:%02d",m,r);
+    return string(buf);
+}
 
+// wakes the main loop for playback events
+static int done_fd = -1;
 
-        if (c == KEY_RESIZE) { draw(); continue; }
+// track metadata
+// title, artist, album, track number and duration straight from the
+// container headers, no decoder involved: ID3v2 (+ Xing/VBRI or a CBR
+// estimate for the length), FLAC STREAMINFO and Vorbis comments, Ogg
+// Vorbis/Opus, MP4 atoms, RIFF/AIFF, and ID3v1/APE at the tail. only the
+// first 4 KB are read in one go, anything else with single preads, and big
+// payloads (cover art) are stepped over
+static const float RG_REFERENCE = -18;     // LUFS, ReplayGain's target
 
-        // cmd exit
+struct TrackMeta {
+    string title, artist, album;
+    int    track = 0, year = 0;
+    int    dur_ms = -1;
+    float  gain = NAN, peak = 0;    // ReplayGain track gain (dB), peak
+    int64_t added = 0;              // file mtime, seconds
+    int64_t mtime_ns = 0;           // file stamp
+    uint64_t size = 0;
+};
+struct HeadReader {
+    int      fd;
+    uint64_t size = 0;
+    uint8_t  head[4096];
+    size_t   hn = 0;
+    explicit HeadReader(int f) : fd(f) {}
+    bool get(uint64_t off,void *p,size_t n){
+        if(off+n<=hn){ memcpy(p,head+off,n); return true; }
+        if(off+n>size) return false;
+        for(size_t k=0;k<n;){
+            ssize_t r=pread(fd,(char*)p+k,n-k,off+k);
+            if(r<=0) return false;
+            k+=r;
+        }
+        return true;
+    }
+    bool get(uint64_t off,size_t n,string &s){ s.resize(n); return get(off,&s[0],n); }
+};
+static uint32_t be32(const uint8_t *p){ return uint32_t(p[0])<<24|p[1]<<16|p[2]<<8|p[3]; }
+static uint32_t le32(const uint8_t *p){ return p[0]|p[1]<<8|p[2]<<16|uint32_t(p[3])<<24; }
+static uint32_t syncsafe(const uint8_t *p){ return (p[0]&0x7f)<<21|(p[1]&0x7f)<<14|(p[2]&0x7f)<<7|(p[3]&0x7f); }
+static void utf8_put(string &s,uint32_t c){
+    if(c<0x80) s+=char(c);
+    else if(c<0x800){ s+=char(0xc0|c>>6); s+=char(0x80|(c&0x3f)); }
+    else if(c<0x10000){ s+=char(0xe0|c>>12); s+=char(0x80|(c>>6&0x3f)); s+=char(0x80|(c&0x3f)); }
+    else { s+=char(0xf0|c>>18); s+=char(0x80|(c>>12&0x3f)); s+=char(0x80|(c>>6&0x3f)); s+=char(0x80|(c&0x3f)); }
+}
+static string latin1(const uint8_t *p,size_t n){
+    string s;
+    for(size_t i=0;i<n;++i) utf8_put(s,p[i]);
+    return s;
+}
+// text in one of ID3's four encodings as UTF-8; separators stay '\0'
+static string id3_text(int enc,const uint8_t *p,size_t n){
+    if(enc==0) return latin1(p,n);
+    if(enc==3) return string((const char*)p,n);
+    string s;
+    bool le=false;      // utf-16 without a BOM is big endian
+    for(size_t i=0;i+1<n;i+=2){
+        uint32_t u=le?p[i]|p[i+1]<<8:p[i]<<8|p[i+1];
+        if(u==0xfeff) continue;
+        if(u==0xfffe){ le=!le; continue; }
+        if(u>=0xd800&&u<0xdc00&&i+3<n){
+            uint32_t v=le?p[i+2]|p[i+3]<<8:p[i+2]<<8|p[i+3];
+            u=0x10000+((u-0xd800)<<10)+(v-0xdc00);
+            i+=2;
+        }
+        utf8_put(s,u);
+    }
+    return s;
+}
+static string nul_cut(const string &s){ return s.substr(0,s.find('\0')); }
+static string rtrim(string s){
+    while(!s.empty()&&(s.back()==' '||s.back()=='\0')) s.pop_back();
+    return s;
+}
+// one KEY=value pair, any of the tag formats' spellings
+static void meta_comment(string k,const string &v,TrackMeta &m){
+    transform(k.begin(),k.end(),k.begin(),::toupper);
+    if(k=="TITLE") m.title=v;
+    else if(k=="ARTIST") m.artist=v;
+    else if((k=="ALBUMARTIST"||k=="ALBUM ARTIST")&&m.artist.empty()) m.artist=v;
+    else if(k=="ALBUM") m.album=v;
+    else if(k=="TRACKNUMBER"||k=="TRACK") m.track=atoi(v.c_str());
+    else if(k=="DATE"||k=="YEAR") m.year=atoi(v.c_str());
+    else if(k=="REPLAYGAIN_TRACK_GAIN") m.gain=strtof(v.c_str(),nullptr);
+    else if(k=="REPLAYGAIN_TRACK_PEAK") m.peak=strtof(v.c_str(),nullptr);
+    // opus: Q7.8 dB towards -23 LUFS
+    else if(k=="R128_TRACK_GAIN") m.gain=atoi(v.c_str())/256.f+(RG_REFERENCE+23);
+}
+// a Vorbis comment list, as found in FLAC, Ogg Vorbis and Opus, through
+// rd(off, n, out) over the block; oversized entries (pictures) are skipped
+template<class R> static void meta_vorbis(R rd,TrackMeta &m){
+    string b;
+    if(!rd(0,4,b)) return;
+    uint64_t i=4+le32((const uint8_t*)b.data());
+    if(!rd(i,4,b)) return;
+    uint32_t count=le32((const uint8_t*)b.data()); i+=4;
+    while(count--&&rd(i,4,b)){
+        uint32_t len=le32((const uint8_t*)b.data()); i+=4;
+        if(len<=4096){
+            if(!rd(i,len,b)) return;
+            auto eq=b.find('=');
+            if(eq!=string::npos) meta_comment(b.substr(0,eq),b.substr(eq+1),m);
+        }
+        i+=len;
+    }
+}
+
+static void meta_id3v2(HeadReader &r,uint64_t &audio_at,TrackMeta &m){
+    const uint8_t *h=r.head;
+    int ver=h[3];
+    uint64_t end=10+syncsafe(h+6), off=10;
+    audio_at=end+(h[5]&0x10?10:0);
+    if(ver<2||ver>4) return;
+    if(h[5]&0x40&&ver>2){   // extended header
+        uint8_t x[4];
+        if(!r.get(10,x,4)) return;
+        off+=ver==4?syncsafe(x):be32(x)+4;
+    }
+    int hs=ver==2?6:10;
+    string d;
+    while(off+hs<=end){
+        uint8_t f[10];
+        if(!r.get(off,f,hs)||!f[0]) break;
+        uint32_t len=ver==2?f[3]<<16|f[4]<<8|f[5]:ver==4?syncsafe(f+4):be32(f+4);
+        string id((const char*)f,ver==2?3:4);
+        off+=hs;
+        if(off+len>end) break;
+        if(len>1&&len<=4096&&r.get(off,len,d)){
+            const uint8_t *p=(const uint8_t*)d.data();
+            string t=id3_text(p[0],p+1,len-1);
+            if(id=="TIT2"||id=="TT2") m.title=nul_cut(t);
+            else if(id=="TPE1"||id=="TP1") m.artist=nul_cut(t);
+            else if(id=="TALB"||id=="TAL") m.album=nul_cut(t);
+            else if(id=="TRCK"||id=="TRK") m.track=atoi(t.c_str());
+            else if(id=="TYER"||id=="TYE"||id=="TDRC") m.year=atoi(t.c_str());
+            else if(id=="TLEN"||id=="TLE") m.dur_ms=atoi(t.c_str());
+            else if(id=="TXXX"||id=="TXX"){
+                // description \0 value
+                size_t z=t.find('\0');
+                if(z!=string::npos) meta_comment(t.substr(0,z),nul_cut(t.substr(z+1)),m);
+            }
+        }
+        off+=len;
+    }
+}
+// length from the first frame: Xing/Info or VBRI frame count, otherwise
+// constant bitrate over the audio bytes
+static int mp3_duration(HeadReader &r,uint64_t at,uint64_t audio_end){
+    uint8_t b[4096];
+    size_t n=min<uint64_t>(sizeof b,audio_end>at?audio_end-at:0);
+    if(n<4||!r.get(at,b,n)) return -1;
+    for(size_t i=0;i+4<=n;++i){
+        int rate, samples, len=mp3_frame(b+i,rate,samples);
+        uint8_t nx[4];
+        if(!len||!r.get(at+i+len,nx,4)) continue;
+        int r2, s2;
+        if(!mp3_frame(nx,r2,s2)) continue;
+        bool v1=(b[i+1]>>3&3)==3, mono=(b[i+3]>>6)==3;
+        size_t x=i+4+(v1?(mono?17:32):(mono?9:17));
+        uint32_t frames=0;
+        if(x+12<=n&&(!memcmp(b+x,"Xing",4)||!memcmp(b+x,"Info",4))&&(be32(b+x+4)&1))
+            frames=be32(b+x+8);
+        else if(i+36+18<=n&&!memcmp(b+i+36,"VBRI",4))
+            frames=be32(b+i+36+14);
+        if(frames) return int(uint64_t(frames)*samples*1000/rate);
+        return int(double(audio_end-at-i)/len*samples*1000/rate);
+    }
+    return -1;
+}
+static void meta_flac(HeadReader &r,TrackMeta &m){
+    for(uint64_t off=4;;){
+        uint8_t h[4];
+        if(!r.get(off,h,4)) return;
+        uint32_t len=h[1]<<16|h[2]<<8|h[3];
+        if((h[0]&0x7f)==0&&len>=18){
+            uint8_t s[18];
+            if(r.get(off+4,s,18)){
+                uint32_t rate=s[10]<<12|s[11]<<4|s[12]>>4;
+                uint64_t total=uint64_t(s[13]&0xf)<<32|be32(s+14);
+                if(rate&&total) m.dur_ms=int(total*1000/rate);
+            }
+        } else if((h[0]&0x7f)==4)
+            meta_vorbis([&](uint64_t o,size_t n,string &b){
+                return o+n<=len&&r.get(off+4+o,n,b); },m);
+        off+=4+len;
+        if(h[0]&0x80) return;
+    }
+}
+static void meta_ogg(HeadReader &r,TrackMeta &m){
+    // body spans of the first two packets: id header and comments
+    vector<pair<uint64_t,uint64_t>> spans[2];
+    int pk=0;
+    uint64_t off=0;
+    while(pk<2&&off<(4u<<20)){     // a comment packet past 4 MB is cover art
+        uint8_t h[27], seg[255];
+        if(!r.get(off,h,27)||memcmp(h,"OggS",4)||!r.get(off+27,seg,h[26])) break;
+        uint64_t body=off+27+h[26], at=body;
+        for(int i=0;i<h[26]&&pk<2;++i){
+            if(seg[i]) spans[pk].push_back({ at, seg[i] });
+            at+=seg[i];
+            if(seg[i]<255) ++pk;
+        }
+        off=body;
+        for(int i=0;i<h[26];++i) off+=seg[i];
+    }
+    // read a packet's bytes [o, o+n) across its spans
+    auto rd=[&](int p){
+        return [&,p](uint64_t o,size_t n,string &b){
+            b.clear();
+            for(auto &s:spans[p]){
+                if(!n) break;
+                if(o>=s.second){ o-=s.second; continue; }
+                size_t k=min<uint64_t>(n,s.second-o);
+                string part;
+                if(!r.get(s.first+o,k,part)) return false;
+                b+=part; n-=k; o=0;
+            }
+            return n==0;
+        };
+    };
+    string id;
+    if(!rd(0)(0,19,id)) return;
+    uint32_t rate=0, skip=0;
+    uint64_t tags=0;
+    if(!id.compare(0,7,"\x01vorbis")){ rate=le32((const uint8_t*)id.data()+12); tags=7; }
+    else if(!id.compare(0,8,"OpusHead")){ rate=48000; skip=uint8_t(id[10])|uint8_t(id[11])<<8; tags=8; }
+    if(!rate) return;
+    meta_vorbis([&](uint64_t o,size_t n,string &b){ return rd(1)(tags+o,n,b); },m);
+    // length: granule position of the last page
+    uint8_t t[8192];
+    size_t n=min<uint64_t>(sizeof t,r.size);
+    if(!r.get(r.size-n,t,n)) return;
+    for(size_t i=n<27?0:n-26;i-->0;)
+        if(!memcmp(t+i,"OggS",4)){
+            uint64_t g=uint64_t(le32(t+i+10))<<32|le32(t+i+6);
+            if(g>skip) m.dur_ms=int((g-skip)*1000/rate);
+            break;
+        }
+}
+// MP4/M4A: moov/mvhd for the length, moov/udta/meta/ilst for tags
+static void meta_mp4(HeadReader &r,uint64_t off,uint64_t end,int depth,bool items,TrackMeta &m){
+    while(off+8<=end&&depth<6){
+        uint8_t h[16];
+        if(!r.get(off,h,8)) return;
+        uint64_t len=be32(h), hl=8;
+        if(len==1){
+            if(!r.get(off+8,h+8,8)) return;
+            len=uint64_t(be32(h+8))<<32|be32(h+12); hl=16;
+        } else if(len==0) len=end-off;
+        if(len<hl||off+len>end) return;
+        string type((const char*)h+4,4);
+        uint64_t body=off+hl, blen=len-hl;
+        if(items){
+            if(blen<16||blen>4096){ off+=len; continue; }
+            // an ilst item: its "data" child holds type, locale, value
+            string d;
+            if(!r.get(body,blen,d)) return;
+            const uint8_t *p=(const uint8_t*)d.data();
+            if(!memcmp(p+4,"data",4)){
+                uint32_t l=be32(p);
+                string v=l>=16&&l<=d.size()?d.substr(16,l-16):string();
+                if(type=="\xa9nam") m.title=v;
+                else if(type=="\xa9""ART") m.artist=v;
+                else if(type=="aART"&&m.artist.empty()) m.artist=v;
+                else if(type=="\xa9""alb") m.album=v;
+                else if(type=="trkn"&&v.size()>=4) m.track=uint8_t(v[2])<<8|uint8_t(v[3]);
+                else if(type=="\xa9""day") m.year=atoi(v.c_str());
+            } else if(type=="----"){
+                // freeform: mean, name, data
+                string name, val;
+                for(size_t i=0;i+8<=d.size();){
+                    size_t l=be32(p+i);
+                    if(l<8||i+l>d.size()) break;
+                    if(!memcmp(p+i+4,"name",4)&&l>12) name=d.substr(i+12,l-12);
+                    if(!memcmp(p+i+4,"data",4)&&l>16) val=d.substr(i+16,l-16);
+                    i+=l;
+                }
+                meta_comment(name,val,m);
+            }
+        }
+        else if(type=="moov"||type=="udta") meta_mp4(r,body,off+len,depth+1,false,m);
+        else if(type=="ilst") meta_mp4(r,body,off+len,depth+1,true,m);
+        else if(type=="meta") meta_mp4(r,body+4,off+len,depth+1,false,m);   // full atom
+        else if(type=="mvhd"&&blen>=20){
+            uint8_t v[32];
+            if(r.get(body,v,min<uint64_t>(blen,32))){
+                uint64_t scale, dur;
+                if(v[0]==1&&blen>=32){ scale=be32(v+20); dur=uint64_t(be32(v+24))<<32|be32(v+28); }
+                else { scale=be32(v+12); dur=be32(v+16); }
+                if(scale) m.dur_ms=int(dur*1000/scale);
+            }
+        }
+        off+=len;
+    }
+}
+static void meta_riff(HeadReader &r,TrackMeta &m){
+    uint32_t byte_rate=0;
+    for(uint64_t off=12;;){
+        uint8_t h[8];
+        if(!r.get(off,h,8)) break;
+        uint32_t len=le32(h+4);
+        string d;
+        if(!memcmp(h,"fmt ",4)&&len>=12&&r.get(off+8,12,d)) byte_rate=le32((const uint8_t*)d.data()+8);
+        else if(!memcmp(h,"data",4)&&byte_rate) m.dur_ms=int(uint64_t(len)*1000/byte_rate);
+        else if(!memcmp(h,"LIST",4)&&len>=4&&len<=65536&&r.get(off+8,len,d)&&!d.compare(0,4,"INFO")){
+            const uint8_t *p=(const uint8_t*)d.data();
+            for(size_t i=4;i+8<=d.size();){
+                size_t l=le32(p+i+4);
+                if(i+8+l>d.size()) break;
+                string v=nul_cut(d.substr(i+8,l)), id=d.substr(i,4);
+                if(id=="INAM") m.title=v;
+                else if(id=="IART") m.artist=v;
+                else if(id=="IPRD") m.album=v;
+                else if(id=="ITRK"||id=="IPRT") m.track=atoi(v.c_str());
+                else if(id=="ICRD") m.year=atoi(v.c_str());
+                i+=8+l+(l&1);
+            }
+        }
+        off+=8+len+(len&1);
+    }
+}
+static void meta_aiff(HeadReader &r,TrackMeta &m){
+    for(uint64_t off=12;;){
+        uint8_t h[8], c[18];
+        if(!r.get(off,h,8)) return;
+        uint32_t len=be32(h+4);
+        if(!memcmp(h,"COMM",4)&&len>=18&&r.get(off+8,c,18)){
+            // 80-bit extended sample rate
+            int e=((c[8]&0x7f)<<8|c[9])-16383-63;
+            double rate=ldexp(double(uint64_t(be32(c+10))<<32|be32(c+14)),e);
+            if(rate>0) m.dur_ms=int(be32(c+2)*1000.0/rate);
+            return;
+        }
+        off+=8+len+(len&1);
+    }
+}
+// ID3v1 and APEv2 at the end of the file; only fill what the header left
+// empty. returns the bytes they take, which aren't audio
+static uint64_t meta_tail(HeadReader &r,TrackMeta &m){
+    uint64_t used=0;
+    uint8_t v1[128];
+    TrackMeta t;
+    if(r.size>=128&&r.get(r.size-128,v1,128)&&!memcmp(v1,"TAG",3)){
+        used=128;
+        t.title=rtrim(latin1(v1+3,30)); t.artist=rtrim(latin1(v1+33,30)); t.album=rtrim(latin1(v1+63,30));
+        t.year=atoi(latin1(v1+93,4).c_str());
+        if(!v1[125]) t.track=v1[126];
+    }
+    uint8_t f[32];
+    if(r.size>=used+32&&r.get(r.size-used-32,f,32)&&!memcmp(f,"APETAGEX",8)){
+        uint32_t size=le32(f+12), count=le32(f+16);
+        uint64_t at=r.size-used-size;
+        string d;
+        if(size>32&&size<=r.size-used&&size<=65536&&r.get(at,size-32,d)){
+            const uint8_t *p=(const uint8_t*)d.data();
+            for(size_t i=0;count--&&i+8<d.size();){
+                uint32_t l=le32(p+i);
+                size_t k=d.find('\0',i+8);
+                if(k==string::npos||k+1+l>d.size()) break;
+                meta_comment(d.substr(i+8,k-i-8),d.substr(k+1,l),t);
+                i=k+1+l;
+            }
+        }
+        used+=size+(le32(f+20)&0x80000000?32:0);   // header present too
+    }
+    if(m.title.empty())  m.title=t.title;
+    if(m.artist.empty()) m.artist=t.artist;
+    if(m.album.empty())  m.album=t.album;
+    if(!m.track)         m.track=t.track;
+    if(!m.year)          m.year=t.year;
+    if(isnan(m.gain)){ m.gain=t.gain; m.peak=t.peak; }
+    return used;
+}
+bool meta_read(const fs::path &f,TrackMeta &m){
+    HeadReader r{ open(f.c_str(),O_RDONLY|O_CLOEXEC) };
+    if(r.fd<0) return false;
+    struct stat st{};
+    if(fstat(r.fd,&st)==0) r.size=st.st_size;
+    ssize_t n=pread(r.fd,r.head,min<uint64_t>(sizeof r.head,r.size),0);
+    r.hn=n>0?n:0;
+    m=TrackMeta{};
+    m.added=st.st_mtim.tv_sec;
+    m.mtime_ns=int64_t(st.st_mtim.tv_sec)*1000000000+st.st_mtim.tv_nsec;
+    m.size=r.size;
+    const uint8_t *h=r.head;
+    if(r.hn>=10&&!memcmp(h,"ID3",3)){
+        uint64_t audio_at;
+        meta_id3v2(r,audio_at,m);
+        uint64_t tail=meta_tail(r,m);
+        if(m.dur_ms<=0) m.dur_ms=mp3_duration(r,audio_at,r.size-tail);
+    }
+    else if(r.hn>=4&&!memcmp(h,"fLaC",4)) meta_flac(r,m);
+    else if(r.hn>=4&&!memcmp(h,"OggS",4)) meta_ogg(r,m);
+    else if(r.hn>=12&&!memcmp(h,"RIFF",4)&&!memcmp(h+8,"WAVE",4)) meta_riff(r,m);
+    else if(r.hn>=12&&!memcmp(h,"FORM",4)&&(!memcmp(h+8,"AIFF",4)||!memcmp(h+8,"AIFC",4))) meta_aiff(r,m);
+    else if(r.hn>=8&&!memcmp(h+4,"ftyp",4)) meta_mp4(r,0,r.size,0,false,m);
+    else {
+        // bare mp3 / aac, tags at the end if anywhere
+        uint64_t tail=meta_tail(r,m);
+        m.dur_ms=mp3_duration(r,0,r.size-tail);
+    }
+    close(r.fd);
+    return true;
+}
+
+// tag reader
+// listings hand their untagged tracks over a directory at a time; the
+// directory is cut into chunks of up to 256 tracks for a pool of
+// low-priority threads. the thread finishing the last chunk folds the tags
+// into the directory index (keeping any duration or gain noted meanwhile)
+// and posts the directory to the UI through tags.fd
+struct MetaDir {
+    fs::path      dir;
+    int64_t       mtime;
+    vector<Entry> v;        // the whole listing, dirs included
+    atomic<int>   left{0};  // chunks still running
+};
+static struct MetaPool {
+    mutex    m;
+    condition_variable cv;
+    deque<pair<shared_ptr<MetaDir>,size_t>> todo;   // dir, first entry
+    set<pair<string,int64_t>> seen;
+    vector<thread> pool;
+    bool     quit = false;
+    vector<shared_ptr<MetaDir>> done;   // not yet picked up by the UI
+    int      fd = -1;
+} tags;
+static const size_t META_CHUNK = 256;
+
+// hand a tagged listing to the UI
+static void meta_post(const shared_ptr<MetaDir> &d){
+    {
+        lock_guard<mutex> lk(tags.m);
+        if(tags.quit) return;
+        tags.done.push_back(d);
+    }
+    uint64_t one=1;
+    ssize_t r=write(tags.fd,&one,sizeof one); (void)r;
+}
+void meta_post(const fs::path &dir,int64_t mt,const vector<Entry> &v){
+    if(tags.fd<0) return;
+    auto d=make_shared<MetaDir>();
+    d->dir=dir; d->mtime=mt; d->v=v;
+    meta_post(d);
+}
+static void meta_finish(const shared_ptr<MetaDir> &d){
+    if(dir_mtime(d->dir)!=d->mtime) return;
+    unique_lock<mutex> lk(index_m);
+    vector<Entry> now;
+    if(index_load(d->dir,d->mtime,now)&&now.size()==d->v.size())
+        for(size_t i=0;i<now.size();++i){
+            Entry &x=d->v[i];
+            const Entry &y=now[i];
+            if(x.id!=y.id) continue;
+            if(y.dur_ms>0) x.dur_ms=y.dur_ms;   // measured by playback
+            x.gain_db=y.gain_db; x.peak=y.peak;
+        }
+    index_store(d->dir,d->mtime,d->v);
+    lk.unlock();
+    meta_post(d);
+}
+static void meta_worker(){
+    setpriority(PRIO_PROCESS,gettid(),10);
+    unique_lock<mutex> lk(tags.m);
+    while(true){
+        tags.cv.wait(lk,[]{ return tags.quit||!tags.todo.empty(); });
+        if(tags.quit) return;
+        auto [d,at]=std::move(tags.todo.front());
+        tags.todo.pop_front();
+        lk.unlock();
+        for(size_t i=at,n=0;i<d->v.size()&&n<META_CHUNK;++i){
+            Entry &e=d->v[i];
+            if(e.dir()||e.meta) continue;
+            ++n;
+            TrackMeta t;
+            if(meta_read(e.path(),t)){
+                e.title=std::move(t.title); e.artist=std::move(t.artist);
+                e.album=std::move(t.album); e.track=t.track;
+                e.year=t.year; e.added=t.added;
+                e.mtime_ns=t.mtime_ns; e.size=t.size;
+                if(e.dur_ms<=0&&t.dur_ms>0) e.dur_ms=t.dur_ms;
+            }
+            e.meta=true;    // unreadable ones aren't retried either
+        }
+        if(--d->left==0) meta_finish(d);
+        lk.lock();
+    }
+}
+void meta_want(const fs::path &dir,int64_t mt,const vector<Entry> &v){
+    vector<size_t> starts;
+    for(size_t i=0,n=0;i<v.size();++i){
+        if(v[i].dir()||v[i].meta) continue;
+        if(n++%META_CHUNK==0) starts.push_back(i);
+    }
+    // tags.fd is only set up by the UI, --render has no use for tags
+    if(!mt||starts.empty()||tags.fd<0) return;
+    lock_guard<mutex> lk(tags.m);
+    if(tags.quit||!tags.seen.insert({dir.native(),mt}).second) return;
+    auto d=make_shared<MetaDir>();
+    d->dir=dir; d->mtime=mt; d->v=v;
+    d->left=starts.size();
+    for(size_t s:starts) tags.todo.emplace_back(d,s);
+    // nearly all of it is waiting on the disk
+    int n=clamp(int(thread::hardware_concurrency())*2,4,16);
+    while((int)tags.pool.size()<n) tags.pool.emplace_back(meta_worker);
+    tags.cv.notify_all();
+}
+vector<shared_ptr<MetaDir>> meta_results(){
+    lock_guard<mutex> lk(tags.m);
+    return std::move(tags.done);
+}
+void meta_stop(){
+    {
+        lock_guard<mutex> lk(tags.m);
+        tags.quit=true;
+        tags.cv.notify_all();
+    }
+    for(auto &t:tags.pool) t.join();
+    tags.pool.clear();
+}
+
+// library store
+// every track the directory indexes know about, as columns: one row per
+// track, each string interned once into a blob and referred to by id, and a
+// rank per id in case-folded order, so sorting and grouping only compare
+// integers. built on a thread straight from the index files; a directory
+// whose index went stale shows as it was and is relisted right after
+struct Library {
+    string           blob;          // interned strings back to back
+    vector<uint32_t> off{0};        // id -> offset into blob, plus the end
+    vector<uint32_t> rank;          // id -> position in folded order
+    vector<uint32_t> dir, file, title, artist, album;   // string ids
+    vector<uint32_t> pid;           // the track's path, see path pool
+    vector<uint16_t> year, track;
+    vector<int32_t>  dur_ms;
+    vector<uint32_t> added;         // file mtime, seconds
+    vector<uint32_t> by_artist;     // rows by artist, album, track, file
+    // search: trigram bucket -> string ids, see lib_search
+    string           fold;          // tags and file names lower-cased, '\0' after each
+    vector<uint32_t> fold_off;      // id -> offset into fold, plus the end
+    vector<array<uint64_t,2>> initials;     // id -> its words' first one and two letters
+    vector<uint32_t> tri_start, tri_ids;
+    unsigned         gen = 0;       // index_gen it was built at
+    size_t size() const { return file.size(); }
+    string_view str(uint32_t id) const { return string_view(blob).substr(off[id],off[id+1]-off[id]); }
+};
+enum { LIB_ARTIST, LIB_YEAR, LIB_DURATION, LIB_ADDED, LIB_SORTS };
+static const char *lib_sort_names[LIB_SORTS] = { "artist", "year", "duration", "added" };
+
+static void lib_trigrams(Library &L);
+static shared_ptr<const Library> lib_build(vector<fs::path> &stale){
+    auto L=make_shared<Library>();
+    L->gen=index_gen;
+    unordered_map<string_view,uint32_t> ids;
+    deque<string> keep;     // backs the map's keys while the blob grows
+    auto intern=[&](string_view s) -> uint32_t {
+        auto it=ids.find(s);
+        if(it!=ids.end()) return it->second;
+        uint32_t id=L->off.size()-1;
+        keep.emplace_back(s);
+        ids.emplace(keep.back(),id);
+        L->blob+=s;
+        L->off.push_back(L->blob.size());
+        return id;
+    };
+    intern("");     // id 0, missing tags
+    error_code ec;
+    for(auto &f:fs::directory_iterator(cache_dir()/"dirs",ec)){
+        if(f.path().extension()!=".idx") continue;
+        // the directory's path follows the header
+        IdxHeader h;
+        string dp;
+        int fd=open(f.path().c_str(),O_RDONLY|O_CLOEXEC);
+        if(fd<0) continue;
+        if(pread(fd,&h,sizeof h,0)==(ssize_t)sizeof h&&h.path_len<=65536){
+            dp.resize(h.path_len);
+            if(pread(fd,dp.data(),dp.size(),sizeof h)!=(ssize_t)dp.size()) dp.clear();
+        }
+        close(fd);
+        if(dp.empty()) continue;
+        fs::path d(dp);
+        int64_t mt=dir_mtime(d);
+        if(!mt) continue;       // gone
+        IdxMap m(d,-1);
+        if(!m.ok()) continue;
+        if(m.hdr->mtime_ns!=mt) stale.push_back(d);
+        uint32_t di=intern(dp), pd=path_id(dp);
+        for(uint32_t i=0;i<m.hdr->count;++i){
+            const IdxEntry &e=m.ents[i];
+            if(e.type==uint8_t(fs::file_type::directory)) continue;
+            auto s=[&](uint32_t o,uint32_t n){
+                return o+size_t(n)<=m.hdr->names_len ? intern(string_view(m.names+o,n)) : 0u; };
+            L->dir.push_back(di);
+            L->file.push_back(s(e.name_off,e.name_len));
+            L->pid.push_back(path_child(pd,L->str(L->file.back())));
+            L->title.push_back(s(e.tag_off[0],e.tag_len[0]));
+            L->artist.push_back(s(e.tag_off[1],e.tag_len[1]));
+            L->album.push_back(s(e.tag_off[2],e.tag_len[2]));
+            L->year.push_back(e.year);
+            L->track.push_back(e.track);
+            L->dur_ms.push_back(e.dur_ms);
+            L->added.push_back(e.added);
+        }
+    }
+    ids.clear(); keep.clear();
+    // folded order, missing tags last
+    size_t n=L->off.size()-1;
+    vector<uint32_t> o(n);
+    iota(o.begin(),o.end(),0);
+    sort(o.begin(),o.end(),[&](uint32_t a,uint32_t b){
+        string_view x=L->str(a), y=L->str(b);
+        return lexicographical_compare(x.begin(),x.end(),y.begin(),y.end(),
+            [](unsigned char c,unsigned char d){ return tolower(c)<tolower(d); });
+    });
+    L->rank.resize(n);
+    for(size_t i=0;i<n;++i) L->rank[o[i]]=i;
+    L->rank[0]=n;
+    // artist order, the base every other order is stable-sorted from
+    struct K { uint64_t a, b; uint32_t r; };
+    vector<K> k(L->size());
+    for(uint32_t r=0;r<L->size();++r)
+        k[r]={ uint64_t(L->rank[L->artist[r]])<<32|L->rank[L->album[r]],
+               uint64_t(L->track[r])<<32|L->rank[L->file[r]], r };
+    sort(k.begin(),k.end(),[](const K &x,const K &y){
+        return x.a!=y.a ? x.a<y.a : x.b<y.b; });
+    L->by_artist.resize(k.size());
+    for(size_t i=0;i<k.size();++i) L->by_artist[i]=k[i].r;
+    lib_trigrams(*L);
+    return L;
+}
+// every track in the given order; unknown years go last, newest first for
+// the added date, ties keep artist order
+vector<uint32_t> lib_sorted(const Library &L,int by){
+    if(by==LIB_ARTIST) return L.by_artist;
+    vector<pair<uint32_t,uint32_t>> k(L.size());
+    for(size_t i=0;i<k.size();++i){
+        uint32_t r=L.by_artist[i], v=0;
+        if(by==LIB_YEAR)          v=L.year[r]?L.year[r]:UINT32_MAX;
+        else if(by==LIB_DURATION) v=uint32_t(L.dur_ms[r]);   // unknown (-1) last
+        else                      v=UINT32_MAX-L.added[r];
+        k[i]={ v, r };
+    }
+    // stable LSD radix sort on the key, two 16-bit passes
+    vector<pair<uint32_t,uint32_t>> t(k.size());
+    for(int sh=0;sh<32;sh+=16){
+        vector<uint32_t> cnt(65537,0);
+        for(auto &x:k) ++cnt[(x.first>>sh&0xffff)+1];
+        for(int i=0;i<65536;++i) cnt[i+1]+=cnt[i];
+        for(auto &x:k) t[cnt[x.first>>sh&0xffff]++]=x;
+        k.swap(t);
+    }
+    vector<uint32_t> v(k.size());
+    for(size_t i=0;i<k.size();++i) v[i]=k[i].second;
+    return v;
+}
+// where each run of equal ids in col starts, over perm[lo, hi)
+vector<uint32_t> lib_groups(const vector<uint32_t> &col,const vector<uint32_t> &perm,size_t lo,size_t hi){
+    vector<uint32_t> g;
+    for(size_t i=lo;i<hi;++i)
+        if(i==lo||col[perm[i]]!=col[perm[i-1]]) g.push_back(i);
+    return g;
+}
+
+// built on a detached thread; done pokes list_fd like a listing batch. the
+// stale directories are relisted afterwards, and a poke of scan.fd has an
+// open library view rebuild once they're indexed again
+struct LibJob {
+    atomic<bool> done{false};
+    shared_ptr<const Library> lib;
+};
+shared_ptr<LibJob> lib_async(){
+    auto j=make_shared<LibJob>();
+    thread([j]{
+        vector<fs::path> stale;
+        j->lib=lib_build(stale);
+        j->done=true;
+        uint64_t one=1;
+        ssize_t r=write(list_fd,&one,sizeof one); (void)r;
+        if(stale.empty()) return;
+        for(auto &d:stale)
+            try { list_items(d); } catch(const fs::filesystem_error&) {}
+        r=write(scan.fd,&one,sizeof one); (void)r;
+    }).detach();
+    return j;
+}
+
+// library search
+// a query is split into words that have to match, in any order, somewhere
+// in a track's title, artist, album or file name, ignoring ASCII case. the
+// store keeps its distinct strings lower-cased in one blob plus a trigram
+// index over them: a word's candidates are the strings in the shortest
+// posting list among its trigrams. words under three letters only match at
+// the start of a word, found through a mask of each string's initials.
+// candidates are only checked once a row that uses them survives the other
+// words. rows are ranked by field and by whether
+// the word starts a word there; a query that only extends the previous one
+// re-checks just the previous matches
+static const int TRI_BITS = 18;
+static uint32_t tri_bucket(const char *p){
+    uint32_t k=uint32_t((unsigned char)p[0])<<16|(unsigned char)p[1]<<8|(unsigned char)p[2];
+    return (k*2654435761u)>>(32-TRI_BITS);
+}
+// bit for a character in a mask of word initials, and for the first two
+// characters of a word in the second mask
+static uint64_t initial_bit(char c){
+    if(c>='a'&&c<='z') return 1ull<<(c-'a');
+    if(c>='0'&&c<='9') return 1ull<<(26+c-'0');
+    return 1ull<<(36+(unsigned char)c%28);
+}
+static uint64_t initial2_bit(const char *p){
+    return 1ull<<(((unsigned char)p[0]*31u+(unsigned char)p[1])%64);
+}
+static bool word_start(const char *p,const char *base){
+    return p==base||!isalnum((unsigned char)p[-1]);
+}
+static string_view fold_text(const Library &L,uint32_t id){
+    uint32_t a=L.fold_off[id], b=L.fold_off[id+1];
+    return b>a ? string_view(L.fold).substr(a,b-a-1) : string_view();
+}
+static void lib_trigrams(Library &L){
+    size_t n=L.off.size()-1;
+    vector<uint8_t> use(n,0);   // 1 tag, 2 file name
+    for(auto *c:{ &L.title, &L.artist, &L.album }) for(uint32_t id:*c) use[id]=1;
+    for(uint32_t id:L.file) use[id]=2;
+    use[0]=0;
+    L.fold_off.resize(n+1);
+    for(uint32_t id=0;id<n;++id){
+        L.fold_off[id]=L.fold.size();
+        if(!use[id]) continue;
+        string_view s=L.str(id);
+        size_t dot=s.rfind('.');
+        if(use[id]==2&&dot!=string_view::npos&&dot>0) s=s.substr(0,dot);
+        for(char c:s) L.fold+=char(tolower((unsigned char)c));
+        L.fold+='\0';
+    }
+    L.fold_off[n]=L.fold.size();
+    L.initials.assign(n,{0,0});
+    for(uint32_t id=0;id<n;++id){
+        string_view t=fold_text(L,id);
+        for(size_t i=0;i<t.size();++i){
+            if(!word_start(t.data()+i,t.data())) continue;
+            L.initials[id][0]|=initial_bit(t[i]);
+            if(i+1<t.size()) L.initials[id][1]|=initial2_bit(t.data()+i);
+        }
+    }
+    L.tri_start.assign((1u<<TRI_BITS)+1,0);
+    vector<uint32_t> b;
+    auto grams=[&](uint32_t id){
+        b.clear();
+        string_view s=fold_text(L,id);
+        for(size_t i=0;i+3<=s.size();++i) b.push_back(tri_bucket(s.data()+i));
+        sort(b.begin(),b.end());
+        b.erase(unique(b.begin(),b.end()),b.end());
+    };
+    for(uint32_t id=0;id<n;++id){
+        grams(id);
+        for(uint32_t x:b) ++L.tri_start[x+1];
+    }
+    for(size_t i=0;i+1<L.tri_start.size();++i) L.tri_start[i+1]+=L.tri_start[i];
+    L.tri_ids.resize(L.tri_start.back());
+    vector<uint32_t> at(L.tri_start.begin(),L.tri_start.end()-1);
+    for(uint32_t id=0;id<n;++id){
+        grams(id);
+        for(uint32_t x:b) L.tri_ids[at[x]++]=id;
+    }
+}
+
+struct LibSearch {
+    shared_ptr<const Library> L;
+    string q;                       // what the results are for
+    vector<uint32_t> matched;       // rows in artist order
+    vector<uint32_t> hits;          // the same, best first
+};
+void lib_search(LibSearch &s,const shared_ptr<const Library> &L,const string &query){
+    string q;
+    for(char c:query) q+=char(tolower((unsigned char)c));
+    auto split=[](const string &q){
+        vector<string> v;
+        istringstream in(q);
+        for(string w;in>>w&&v.size()<8;) v.push_back(w);
+        return v;
+    };
+    vector<string> words=split(q);
+    // typing on only narrows the matches while no word grows from the
+    // word-start rule (under 3 letters) into a substring search: "ov"
+    // doesn't match "Love", "ove" does
+    bool narrow=s.L==L&&!s.q.empty()&&q.compare(0,s.q.size(),s.q)==0;
+    if(narrow){
+        vector<string> was=split(s.q);
+        for(size_t i=0;i<was.size()&&i<words.size();++i)
+            if(was[i].size()<3&&words[i].size()>=3) narrow=false;
+    }
+    // long words first, they reject the most rows for the least work
+    stable_sort(words.begin(),words.end(),[](auto &a,auto &b){ return a.size()>b.size(); });
+    s.L=L; s.hits.clear();
+    // no words match nothing, and nothing is no base to narrow from
+    if(words.empty()){ s.q.clear(); s.matched.clear(); return; }
+    s.q=q;
+    // per word and string: 0 no match, 1 inside a word, 2 at a word start,
+    // UNK not checked yet
+    const uint8_t UNK=0xff;
+    size_t n=L->off.size()-1;
+    vector<vector<uint8_t>> hit(words.size());
+    auto check=[&](uint32_t id,const string &w) -> uint8_t {
+        string_view t=fold_text(*L,id);
+        const char *b=t.data(), *e=b+t.size();
+        if(w.size()<3){
+            for(const char *p=b;(p=(const char*)memchr(p,w[0],e-p));++p)
+                if(word_start(p,b)&&p+w.size()<=e&&!memcmp(p,w.data(),w.size())) return 2;
+            return 0;
+        }
+        auto p=(const char*)memmem(b,t.size(),w.data(),w.size());
+        if(!p) return 0;
+        return word_start(p,b) ? 2 : 1;
+    };
+    for(size_t k=0;k<words.size();++k){
+        const string &w=words[k];
+        vector<uint8_t> &h=hit[k];
+        if(w.size()>=3){
+            size_t best=0, bn=SIZE_MAX;
+            for(size_t i=0;i+3<=w.size();++i){
+                uint32_t x=tri_bucket(w.data()+i);
+                size_t m=L->tri_start[x+1]-L->tri_start[x];
+                if(m<bn){ bn=m; best=x; }
+            }
+            h.assign(n,0);
+            for(uint32_t i=L->tri_start[best];i<L->tri_start[best+1];++i) h[L->tri_ids[i]]=UNK;
+        } else {
+            int m=w.size()-1;
+            uint64_t bit=m ? initial2_bit(w.data()) : initial_bit(w[0]);
+            uint8_t yes=m ? UNK : 2;
+            h.resize(n);
+            for(size_t id=0;id<n;++id) h[id]=L->initials[id][m]&bit ? yes : 0;
+        }
+    }
+    // title, artist, album, file; a match at a word start counts double
+    static const int weight[4]={ 4, 3, 2, 1 };
+    vector<uint32_t> from;
+    if(narrow) from.swap(s.matched);
+    const vector<uint32_t> &rows=narrow?from:L->by_artist;
+    vector<uint8_t> score;
+    s.matched.clear();
+    for(uint32_t r:rows){
+        uint32_t f[4]={ L->title[r], L->artist[r], L->album[r], L->file[r] };
+        int total=0;
+        size_t k=0;
+        for(;k<words.size();++k){
+            int b=0;
+            for(int i=0;i<4&&b<2*weight[i];++i){   // nothing later can beat b
+                uint8_t &x=hit[k][f[i]];
+                if(x==UNK) x=check(f[i],words[k]);
+                b=max(b,x*weight[i]);
+            }
+            if(!b) break;
+            total+=b;
+        }
+        if(k<words.size()) continue;
+        s.matched.push_back(r);
+        score.push_back(uint8_t(min(total,255)));
+    }
+    // counting sort by score, stable so ties stay in artist order
+    uint32_t cnt[257]={};
+    for(uint8_t x:score) ++cnt[256-x];
+    for(int i=0;i<256;++i) cnt[i+1]+=cnt[i];
+    s.hits.resize(s.matched.size());
+    for(size_t i=0;i<score.size();++i) s.hits[cnt[255-score[i]]++]=s.matched[i];
+}
+
+// loudness
+// ReplayGain-style levelling: each track gets a gain that brings it to
+// -18 LUFS, from its own REPLAYGAIN_TRACK_GAIN / R128_TRACK_GAIN tags when
+// it has them, otherwise from an EBU R128 measurement of the decoded PCM
+// (K-weighted, 400 ms blocks gated at -70 LUFS and -10 LU, 4x oversampled
+// true peak). results live in the directory index next to the duration
+// track gain and peak from tags, without decoding anything
+static bool rg_tags(const fs::path &f,float &gain,float &peak){
+    TrackMeta m;
+    if(!meta_read(f,m)||!isfinite(m.gain)) return false;
+    gain=m.gain; peak=m.peak;
+    return true;
+}
+
+struct Biquad {
+    double b0,b1,b2,a1,a2, z1[2]={}, z2[2]={};
+    float run(float x,int c){
+        double y=b0*x+z1[c];
+        z1[c]=b1*x-a1*y+z2[c];
+        z2[c]=b2*x-a2*y;
+        return float(y);
+    }
+};
+// EBU R128 integrated loudness (LUFS) and true peak of interleaved stereo
+// PCM in device format
+static void loudness(const Uint8 *pcm,size_t bytes,Uint16 fmt,int rate,float &lufs,float &peak){
+    // K-weighting: high shelf then high pass, coefficients for any rate
+    double K=tan(M_PI*1681.974450955533/rate), Q=0.7071752369554196;
+    double Vh=pow(10,3.999843853973347/20), Vb=pow(Vh,0.4996667741545416);
+    double a0=1+K/Q+K*K;
+    Biquad shelf{ (Vh+Vb*K/Q+K*K)/a0, 2*(K*K-Vh)/a0, (Vh-Vb*K/Q+K*K)/a0,
+                  2*(K*K-1)/a0, (1-K/Q+K*K)/a0 };
+    K=tan(M_PI*38.13547087602444/rate); Q=0.5003270373238773;
+    a0=1+K/Q+K*K;
+    Biquad hp{ 1, -2, 1, 2*(K*K-1)/a0, (1-K/Q+K*K)/a0 };
+    // true peak: 4 phase windowed-sinc interpolation between samples
+    static const int TAPS=12;
+    static float ph[4][TAPS];
+    static once_flag once;
+    call_once(once,[]{
+        for(int p=0;p<4;++p) for(int k=0;k<TAPS;++k){
+            double x=k-TAPS/2+1-p/4.0;
+            double w=0.5+0.5*cos(M_PI*x/(TAPS/2));
+            ph[p][k]=float((x==0?1:sin(M_PI*x)/(M_PI*x))*w);
+        }
+    });
+    bool f32=(fmt==AUDIO_F32SYS);
+    size_t frames=bytes/(f32?8:4);
+    size_t sub=max(1,rate/10);                      // 100 ms
+    vector<double> blocks;                          // 100 ms energies
+    double acc=0;
+    float hist[2][TAPS]={}, pk=0;
+    for(size_t i=0;i<frames;++i){
+        for(int c=0;c<2;++c){
+            float x=f32?((const float*)pcm)[2*i+c]:((const Sint16*)pcm)[2*i+c]/32768.f;
+            float y=hp.run(shelf.run(x,c),c);
+            acc+=double(y)*y;
+            memmove(hist[c],hist[c]+1,(TAPS-1)*sizeof(float));
+            hist[c][TAPS-1]=x;
+            float a=fabsf(hist[c][TAPS/2-1]);
+            pk=max(pk,a);
+            // only samples near the running peak can hide a higher one
+            if(a>=pk*0.7f) for(int p=1;p<4;++p){
+                float s=0;
+                for(int k=0;k<TAPS;++k) s+=ph[p][k]*hist[c][k];
+                pk=max(pk,fabsf(s));
+            }
+        }
+        if((i+1)%sub==0){ blocks.push_back(acc/sub); acc=0; }
+    }
+    peak=pk;
+    // 400 ms gating blocks, 75% overlap
+    vector<double> z;
+    for(size_t i=3;i<blocks.size();++i)
+        z.push_back((blocks[i-3]+blocks[i-2]+blocks[i-1]+blocks[i])/4);
+    auto lk=[](double e){ return -0.691+10*log10(max(e,1e-12)); };
+    auto mean=[&](double gate){
+        double s=0; size_t n=0;
+        for(double e:z) if(lk(e)>gate){ s+=e; ++n; }
+        return n?s/n:0.0;
+    };
+    double m=mean(-70);
+    lufs=m>0?float(lk(mean(lk(m)-10))):-70.f;
+}
+
+// track input
+// decoders read tracks through an SDL_RWops over a read-only mapping of the
+// whole file, so reads are a memcpy out of the page cache with no syscall
+// each. network and FUSE filesystems keep SDL's buffered read() instead: a
+// file that changes or goes away under a mapping raises SIGBUS there
+static bool mappable(int fd){
+    struct statfs sf;
+    if(fstatfs(fd,&sf)!=0) return false;
+    switch((unsigned long)sf.f_type){
+    case 0x6969:            // nfs
+    case 0x517b:            // smb
+    case 0xff534d42:        // cifs
+    case 0xfe534d42:        // smb2
+    case 0x65735546:        // fuse
+    case 0x00c36400:        // ceph
+    case 0x01021997:        // 9p
+    case 0x5346414f:        // afs
+    case 0x73757245:        // coda
+        return false;
+    }
+    return true;
+}
+
+struct MapIn { const Uint8 *base; uint64_t size, pos; };
+static Sint64 map_size(SDL_RWops *rw){ return ((MapIn*)rw->hidden.unknown.data1)->size; }
+static Sint64 map_seek(SDL_RWops *rw,Sint64 o,int whence){
+    MapIn *m=(MapIn*)rw->hidden.unknown.data1;
+    int64_t p=whence==RW_SEEK_SET?o:whence==RW_SEEK_CUR?int64_t(m->pos)+o:int64_t(m->size)+o;
+    if(p<0) return -1;
+    return m->pos=p;
+}
+static size_t map_read(SDL_RWops *rw,void *dst,size_t size,size_t num){
+    MapIn *m=(MapIn*)rw->hidden.unknown.data1;
+    if(!size||m->pos>=m->size) return 0;
+    size_t n=min<uint64_t>(num,(m->size-m->pos)/size);
+    memcpy(dst,m->base+m->pos,n*size);
+    m->pos+=n*size;
+    return n;
+}
+static int map_close(SDL_RWops *rw){
+    MapIn *m=(MapIn*)rw->hidden.unknown.data1;
+    munmap((void*)m->base,m->size);
+    delete m;
+    SDL_FreeRW(rw);
+    return 0;
+}
+// whole: the decoder reads it all right away, so fault it in ahead too
+static SDL_RWops *track_open(const fs::path &f,bool whole){
+    int fd=open(f.c_str(),O_RDONLY|O_CLOEXEC);
+    if(fd<0) return nullptr;
+    struct stat st;
+    void *p=MAP_FAILED;
+    if(fstat(fd,&st)==0&&st.st_size>0&&mappable(fd))
+        p=mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(p==MAP_FAILED) return SDL_RWFromFile(f.c_str(),"rb");
+    madvise(p,st.st_size,MADV_SEQUENTIAL);
+    if(whole) madvise(p,st.st_size,MADV_WILLNEED);
+    SDL_RWops *rw=SDL_AllocRW();
+    if(!rw){ munmap(p,st.st_size); return nullptr; }
+    rw->hidden.unknown.data1=new MapIn{ (const Uint8*)p, uint64_t(st.st_size), 0 };
+    rw->size=map_size; rw->seek=map_seek;
+    rw->read=map_read; rw->write=nullptr; rw->close=map_close;
+    rw->type=SDL_RWOPS_UNKNOWN;
+    return rw;
+}
+// Mix_LoadMUS picks the decoder by extension before sniffing, keep that
+static Mix_Music *music_open(const fs::path &f){
+    SDL_RWops *rw=track_open(f,false);
+    if(!rw) return nullptr;
+    string ext=f.extension().string();
+    transform(ext.begin(),ext.end(),ext.begin(),::tolower);
+    Mix_MusicType t = ext==".mp3"  ? MUS_MP3  : ext==".flac" ? MUS_FLAC
+                    : ext==".ogg"  ? MUS_OGG  : ext==".opus" ? MUS_OPUS
+                    : ext==".wav"  ? MUS_WAV  : MUS_NONE;
+    return Mix_LoadMUSType_RW(rw,t,1);
+}
+
+// playback
+// the UI only goes through the pb_* functions, which post commands to the
+// engine over a lock-free queue and read back atomics; no Mix_* calls happen
+// on the UI thread.
+//
+// engine: a loader thread decodes every track whole into device-format PCM
+// (Mix_LoadWAV_RW, SDL_mixer has no incremental decoder), the one started
+// by hand as well as its successor, which is decoded ahead. the feeder
+// thread copies that PCM into a lock-free single-producer/single-consumer
+// ring and our Mix_HookMusic callback drains the ring. track changes,
+// seeks and flushes travel next to the PCM as segments, so the callback
+// switches tracks at the exact byte: decoded tracks follow each other
+// gapless or crossfaded. a track whose PCM would pass DECODE_MAX_BYTES
+// isn't decoded: started by hand it is streamed by SDL_mixer's own
+// Mix_Music, which hands over to its decoded successor within a device
+// buffer; as a successor it streams after END
+enum PbEvent { PB_NONE, PB_STARTED, PB_ENDED, PB_FAILED };
+
+// feed, after and heard can each hold one: 128 MB is 12 min of 16 bit
+// 44.1 kHz stereo, 5 min of float at 48 kHz
+static const uint64_t DECODE_MAX_BYTES = 128u<<20;
+
+// single-producer/single-consumer queue, lock-free, N a power of two
+template<class T,size_t N> struct Spsc {
+    T buf[N];
+    atomic<size_t> head{0}, tail{0};
+    bool push(T v){
+        size_t h=head.load(memory_order_relaxed);
+        if(h-tail.load(memory_order_acquire)==N) return false;
+        buf[h&(N-1)]=std::move(v);
+        head.store(h+1,memory_order_release);
+        return true;
+    }
+    // consumer: i-th waiting item or null
+    T *peek(size_t i=0){
+        size_t t=tail.load(memory_order_relaxed);
+        return t+i<head.load(memory_order_acquire)?&buf[(t+i)&(N-1)]:nullptr;
+    }
+    void drop(size_t n=1){ tail.store(tail.load(memory_order_relaxed)+n,memory_order_release); }
+    bool pop(T &v){
+        T *p=peek();
+        if(!p) return false;
+        v=std::move(*p); drop();
+        return true;
+    }
+};
+
+// triple buffer, lock-free: the producer always has a slot to write, the
+// consumer always gets the newest complete one; bit 4 of mid marks it fresh
+template<class T> struct Triple {
+    T buf[3];
+    atomic<int> mid{1};
+    int back = 0, front = 2;
+    T &back_buf(){ return buf[back]; }
+    void publish(){ back=mid.exchange(back|4,memory_order_acq_rel)&3; }
+    bool taken() const { return !(mid.load(memory_order_relaxed)&4); }
+    const T *take(){
+        if(taken()) return nullptr;
+        front=mid.exchange(front,memory_order_acq_rel)&3;
+        return &buf[front];
+    }
+};
+
+// PCM byte ring; head/tail are absolute byte counts so segment positions
+// stay comparable across wraps
+struct PcmRing {
+    vector<Uint8> buf;
+    size_t mask = 0;
+    atomic<uint64_t> head{0}, tail{0};
+    void init(size_t bytes){
+        size_t n=1; while(n<bytes) n<<=1;
+        buf.assign(n,0); mask=n-1;
+    }
+    size_t space() const {
+        return buf.size()-size_t(head.load(memory_order_relaxed)-tail.load(memory_order_acquire));
+    }
+    void write(const Uint8 *p,size_t n){     // producer, n <= space()
+        uint64_t h=head.load(memory_order_relaxed);
+        size_t at=h&mask, k=min(n,buf.size()-at);
+        memcpy(&buf[at],p,k); memcpy(&buf[0],p+k,n-k);
+        head.store(h+n,memory_order_release);
+    }
+    size_t read(Uint8 *p,size_t n){          // consumer
+        uint64_t t=tail.load(memory_order_relaxed);
+        n=min<size_t>(n,head.load(memory_order_acquire)-t);
+        size_t at=t&mask, k=min(n,buf.size()-at);
+        memcpy(p,&buf[at],k); memcpy(p+k,&buf[0],n-k);
+        tail.store(t+n,memory_order_release);
+        return n;
+    }
+};
+
+// what the callback does when its read position reaches `at`
+struct Segment {
+    enum Kind : uint8_t { TRACK, END, STOP, FLUSH } kind = TRACK;
+    bool     fresh = false;     // TRACK: a new track, not a seek inside one
+    int      token = -1;
+    uint64_t at = 0;            // ring byte position
+    uint32_t pos0 = 0, len = 0; // track bytes at `at`, track length
+    float    gain = 1;          // TRACK: loudness levelling, linear
+};
+struct Cmd {
+    enum Op : uint8_t { PLAY, QUEUE, PAUSE, RESUME, SEEK, STOP, VOLUME, OUTPUT, NORMALIZE, EQ, FADE } op;
+    fs::path f = {};
+    int      token = -1;    // OUTPUT: profile, EQ: on, FADE: curve
+    double   t = 0;         // OUTPUT: buffer ms, NORMALIZE: on, EQ: preamp dB, FADE: ms
+    array<float,EQ_BANDS> eq{};     // EQ: band gains, dB
+};
+// equalizer as the callback runs it: the active bands as a cascade of
+// biquads taken two at a time. the four lanes of a step hold L/R of the
+// first band of a pair on this frame and L/R of the second band on the
+// first band's output from the frame before, so a serial cascade still
+// fills a vector; each pair delays the output by one frame
+struct EqPair {
+    float b0[4], b1[4], b2[4], a1[4], a2[4];    // per lane
+    float z1[4], z2[4], y[4];                   // state, last output
+};
+struct EqStage {
+    int    n = 0;           // pairs, 0 = pass through
+    EqPair p[(EQ_BANDS+1)/2];
+};
+struct Src {
+    Mix_Chunk *pcm = nullptr;
+    int        token = -1;
+    uint32_t   pos = 0;       // bytes already fed
+    float      gain = 1;
+};
+// a track for the loader: a successor, or one to start as soon as it's in
+struct LoadJob {
+    fs::path f;
+    int      token = -1;
+    bool     play = false;
+    int      dev_rate = 0;      // the device's, 0 if any rate plays as it is
+};
+// what the loader hands back: the PCM, or for a PLAY too long to decode an
+// opened stream, or the rate to reopen the device at before decoding
+struct Decoded {
+    Mix_Chunk *pcm = nullptr;
+    Mix_Music *music = nullptr;
+    int        token = -1;
+    unsigned   gen = 0;
+    float      gain = 1;
+    bool       play = false;
+    int        rate = 0;
+    SeekIndex  seek;            // music: as far as it's been built
+};
+// the newest output as the callback saw it, device format, for the spectrum
+static const int TAP_BYTES = 32768;
+struct TapBlock {
+    Uint16 fmt;
+    int    rate, frame_bytes, len;
+    Uint8  pcm[TAP_BYTES];
+};
+
+static struct Eng {
+    // format
+    int        rate = 44100, frame_bytes = 4;
+    Uint16     fmt = AUDIO_S16SYS;
+    int        buffer_ms = 500;
+    int        latency_frames = 2048;   // device buffer, played after we hand it over
+    // clock: track position at the start of the last block handed to the
+    // device, its length and when. seqlock, one writer at a time
+    atomic<unsigned>     clk_seq{0};
+    atomic<uint64_t>     clk_pos{0};
+    atomic<uint32_t>     clk_n{0};
+    atomic<int64_t>      clk_ns{0};
+    // callback side
+    PcmRing              ring;
+    Spsc<Segment,64>     segs;
+    atomic<bool>         paused{false};
+    atomic<int>          vol{MIX_MAX_VOLUME};
+    atomic<bool>         normalize{false};
+    atomic<int>          cur_token{-1};
+    atomic<uint64_t>     len_bytes{0};
+    atomic<bool>         loaded{false};
+    atomic<long>         underruns{0};
+    uint64_t             seg_at = 0;      // callback-only: current TRACK segment
+    uint32_t             seg_pos0 = 0;
+    bool                 seg_live = false;
+    float                seg_gain = 1;
+    EqStage             *eq = nullptr;    // postmix-only
+    atomic<EqStage*>     eq_next{nullptr};    // feeder -> postmix, one at a time
+    Spsc<EqStage*,8>     eq_old;              // postmix -> feeder, to free
+    atomic<bool>         tap_on{false};
+    Uint8                tap_hist[TAP_BYTES];     // postmix-only, rolling
+    uint64_t             tap_w = 0;
+    Triple<TapBlock>     tap;                     // postmix -> UI
+    // UI -> feeder
+    Spsc<Cmd,64>         cmds;
+    int                  wake_fd = -1;
+    // events for the UI, each also pokes done_fd
+    atomic<int>          ev_started{-1};
+    atomic<bool>         ev_end{false}, ev_fail{false};
+    // feeder-only
+    Src        feed, after, heard;  // being fed / decoded successor / fed earlier
+    bool       ended = false;         // END pushed for feed
+    int        queued_token = -1;     // successor asked for
+    fs::path   queued_path;
+    fs::path   play_path;             // PLAY waiting on the loader
+    int        play_token = -1;
+    bool       hooked = false;        // our callback owns the output
+    int        fade_ms = 0, fade_curve = 0;
+    uint32_t   fade_at = 0, fade_len = 0;  // heard bytes mixed into feed's first fade_len
+    vector<Uint8> fade_buf;
+    int        profile = 0, want_buffer_ms = 500;  // applied at the next PLAY
+    int        req_rate = 0, req_frames = 0;       // as last requested, the
+    Uint16     req_fmt = 0;                        // device may differ
+    shared_mutex dev_m;             // shared while decoding, owned while reopening
+    atomic<bool> dev_want{false};   // a reopen waits, background decodes hold off
+    mutex        dev_wm;            // ... until dev_cv says it's done
+    condition_variable dev_cv;
+    Mix_Music *music = nullptr;       // streaming path
+    float      stream_gain = 1;
+    fs::path   stream_path;
+    SeekIndex  stream_seek;             // empty until built
+    double     stream_base = 0;         // seconds cut off the front by a splice
+    atomic<bool> stream_done{false};
+    bool       stream_over = false;     // ended, waiting for its successor
+    Cmd        eq_want{ Cmd::EQ, {}, 0 };   // last EQ asked for
+    bool       eq_dirty = false;        // ... not yet handed to the postmix
+    // loader
+    mutex      m;
+    condition_variable cv;
+    deque<LoadJob> jobs;            // a PLAY goes first
+    unsigned   gen = 0;
+    vector<Decoded> done;
+    bool       quit = false;
+    thread     loader, feeder;
+} eng;
+
+static void pb_post(){
+    if(done_fd<0) return;       // --render has no UI to tell
+    uint64_t one=1;
+    ssize_t r=write(done_fd,&one,sizeof one); (void)r;
+}
+static void eng_wake(){
+    uint64_t one=1;
+    ssize_t r=write(eng.wake_fd,&one,sizeof one); (void)r;
+}
+// Mix_HookMusicFinished, runs on the SDL audio thread: only wakes the feeder
+static void music_done(){
+    eng.stream_done=true;
+    eng_wake();
+}
+
+static int64_t now_ns(){
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+// n is 0 while nothing advances: paused, underrun, stopped
+static void clock_publish(uint64_t pos,uint32_t n){
+    unsigned q=eng.clk_seq.load(memory_order_relaxed);
+    eng.clk_seq.store(q+1,memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    eng.clk_pos.store(pos,memory_order_relaxed);
+    eng.clk_n.store(n,memory_order_relaxed);
+    eng.clk_ns.store(now_ns(),memory_order_relaxed);
+    eng.clk_seq.store(q+2,memory_order_release);
+}
+
+// scale in place to the music volume
+// the one per-sample pass over the output: volume times track gain, 4 or
+// 8 samples at a time, saturating for 16 bit
+static void pb_apply_gain(Uint8 *p,int len,float g){
+    if(g==1) return;
+    int i=0;
+    if(eng.fmt==AUDIO_F32SYS){
+        float *f=(float*)p;
+        int n=len/4;
+#if defined(__SSE2__)
+        __m128 k=_mm_set1_ps(g);
+        for(;i+4<=n;i+=4) _mm_storeu_ps(f+i,_mm_mul_ps(_mm_loadu_ps(f+i),k));
+#elif defined(__ARM_NEON)
+        for(;i+4<=n;i+=4) vst1q_f32(f+i,vmulq_n_f32(vld1q_f32(f+i),g));
+#endif
+        for(;i<n;++i) f[i]*=g;
+    } else {
+        Sint16 *s=(Sint16*)p;
+        int n=len/2;
+#if defined(__SSE2__)
+        __m128 k=_mm_set1_ps(g);
+        for(;i+8<=n;i+=8){
+            __m128i v=_mm_loadu_si128((const __m128i*)(s+i));
+            __m128i lo=_mm_srai_epi32(_mm_unpacklo_epi16(v,v),16);
+            __m128i hi=_mm_srai_epi32(_mm_unpackhi_epi16(v,v),16);
+            lo=_mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo),k));
+            hi=_mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi),k));
+            _mm_storeu_si128((__m128i*)(s+i),_mm_packs_epi32(lo,hi));
+        }
+#elif defined(__ARM_NEON)
+        for(;i+8<=n;i+=8){
+            int16x8_t v=vld1q_s16(s+i);
+            float32x4_t lo=vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))),g);
+            float32x4_t hi=vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))),g);
+            vst1q_s16(s+i,vcombine_s16(vqmovn_s32(vcvtq_s32_f32(lo)),vqmovn_s32(vcvtq_s32_f32(hi))));
+        }
+#endif
+        for(;i<n;++i) s[i]=Sint16(clamp(lrintf(s[i]*g),-32768L,32767L));
+    }
+}
+
+// run one biquad pair over n interleaved stereo frames in place
+static void eq_pair(EqPair &q,float *x,int n){
+#if defined(__SSE2__)
+    __m128 b0=_mm_loadu_ps(q.b0), b1=_mm_loadu_ps(q.b1), b2=_mm_loadu_ps(q.b2);
+    __m128 a1=_mm_loadu_ps(q.a1), a2=_mm_loadu_ps(q.a2);
+    __m128 z1=_mm_loadu_ps(q.z1), z2=_mm_loadu_ps(q.z2), y=_mm_loadu_ps(q.y);
+    for(int i=0;i<n;++i,x+=2){
+        __m128 in=_mm_movelh_ps(_mm_castpd_ps(_mm_load_sd((const double*)x)),y);
+        y=_mm_add_ps(_mm_mul_ps(b0,in),z1);
+        z1=_mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1,in),_mm_mul_ps(a1,y)),z2);
+        z2=_mm_sub_ps(_mm_mul_ps(b2,in),_mm_mul_ps(a2,y));
+        _mm_storeh_pi((__m64*)x,y);
+    }
+    _mm_storeu_ps(q.z1,z1); _mm_storeu_ps(q.z2,z2); _mm_storeu_ps(q.y,y);
+#elif defined(__ARM_NEON)
+    float32x4_t b0=vld1q_f32(q.b0), b1=vld1q_f32(q.b1), b2=vld1q_f32(q.b2);
+    float32x4_t a1=vld1q_f32(q.a1), a2=vld1q_f32(q.a2);
+    float32x4_t z1=vld1q_f32(q.z1), z2=vld1q_f32(q.z2), y=vld1q_f32(q.y);
+    for(int i=0;i<n;++i,x+=2){
+        float32x4_t in=vcombine_f32(vld1_f32(x),vget_low_f32(y));
+        y=vmlaq_f32(z1,b0,in);
+        z1=vmlsq_f32(vmlaq_f32(z2,b1,in),a1,y);
+        z2=vmlsq_f32(vmulq_f32(b2,in),a2,y);
+        vst1_f32(x,vget_high_f32(y));
+    }
+    vst1q_f32(q.z1,z1); vst1q_f32(q.z2,z2); vst1q_f32(q.y,y);
+#else
+    for(int i=0;i<n;++i,x+=2){
+        float in[4]={ x[0], x[1], q.y[0], q.y[1] };
+        for(int k=0;k<4;++k){
+            float y=q.b0[k]*in[k]+q.z1[k];
+            q.z1[k]=q.b1[k]*in[k]-q.a1[k]*y+q.z2[k];
+            q.z2[k]=q.b2[k]*in[k]-q.a2[k]*y;
+            q.y[k]=y;
+        }
+        x[0]=q.y[2]; x[1]=q.y[3];
+    }
+#endif
+}
+static void eq_run(Uint8 *stream,int len){
+    if(eng.eq_next.load(memory_order_relaxed)){
+        // no syscall here: the feeder polls while a swap is pending and
+        // frees the old stage on its next round. pushed before the swap,
+        // so it can't see the slot empty and the old one not queued yet
+        if(eng.eq) eng.eq_old.push(eng.eq);
+        eng.eq=eng.eq_next.exchange(nullptr,memory_order_acq_rel);
+    }
+    EqStage *e=eng.eq;
+    if(!e||!e->n) return;
+#if defined(__SSE2__)
+    // flush denormals, decaying filter tails crawl otherwise. only for this
+    // stage, the rest of the callback and SDL get their own mode back
+    unsigned csr=_mm_getcsr();
+    _mm_setcsr(csr|0x8040);
+#endif
+    if(eng.fmt==AUDIO_F32SYS){
+        for(int k=0;k<e->n;++k) eq_pair(e->p[k],(float*)stream,len/8);
+    } else {
+        // 16 bit goes through float in chunks
+        Sint16 *s=(Sint16*)stream;
+        float x[2048];
+        for(int left=len/2;left>0;){
+            int n=min(left,2048);
+            for(int i=0;i<n;++i) x[i]=s[i];
+            for(int k=0;k<e->n;++k) eq_pair(e->p[k],x,n/2);
+            for(int i=0;i<n;++i) s[i]=Sint16(clamp(lrintf(x[i]),-32768L,32767L));
+            s+=n; left-=n;
+        }
+    }
+#if defined(__SSE2__)
+    _mm_setcsr(csr);
+#endif
+}
+// keep the last TAP_BYTES of output and hand them over once the UI has
+// taken the previous copy; only copies, the analysis runs on the UI side
+static void tap_run(const Uint8 *stream,int len){
+    if(!eng.tap_on.load(memory_order_relaxed)) return;
+    if(len>TAP_BYTES){ stream+=len-TAP_BYTES; len=TAP_BYTES; }
+    size_t at=eng.tap_w&(TAP_BYTES-1), k=min<size_t>(len,TAP_BYTES-at);
+    memcpy(eng.tap_hist+at,stream,k); memcpy(eng.tap_hist,stream+k,len-k);
+    eng.tap_w+=len;
+    if(!eng.tap.taken()) return;
+    TapBlock &b=eng.tap.back_buf();
+    b.fmt=eng.fmt; b.rate=eng.rate; b.frame_bytes=eng.frame_bytes;
+    b.len=int(min<uint64_t>(eng.tap_w,TAP_BYTES));
+    b.len-=b.len%eng.frame_bytes;
+    at=(eng.tap_w-b.len)&(TAP_BYTES-1); k=min<size_t>(b.len,TAP_BYTES-at);
+    memcpy(b.pcm,eng.tap_hist+at,k); memcpy(b.pcm+k,eng.tap_hist,b.len-k);
+    eng.tap.publish();
+}
+// Mix_SetPostMix, audio thread: everything that goes out, hooked or streamed
+static void eng_postmix(void*,Uint8 *stream,int len){
+    eq_run(stream,len);
+    tap_run(stream,len);
+}
+
+// apply segments that are due, audio thread
+static void eng_segments(){
+    // a FLUSH throws away everything queued before it
+    size_t last=0; bool fl=false;
+    for(size_t i=0;Segment *s=eng.segs.peek(i);++i)
+        if(s->kind==Segment::FLUSH){ last=i; fl=true; }
+    if(fl){
+        // the callback may already have read past it into post-flush data
+        Segment *s=eng.segs.peek(last);
+        if(s->at>eng.ring.tail.load(memory_order_relaxed))
+            eng.ring.tail.store(s->at,memory_order_release);
+        eng.segs.drop(last+1);
+        eng.seg_live=false;
+    }
+    uint64_t t=eng.ring.tail.load(memory_order_relaxed);
+    while(Segment *s=eng.segs.peek()){
+        if(s->at>t) break;
+        switch(s->kind){
+        case Segment::TRACK:
+            eng.seg_at=s->at; eng.seg_pos0=s->pos0; eng.seg_live=true;
+            eng.seg_gain=s->gain;
+            eng.cur_token=s->token;
+            eng.len_bytes=s->len;
+            eng.loaded=true;
+            if(s->fresh){ eng.ev_started=s->token; pb_post(); }
+            break;
+        case Segment::END:
+            eng.seg_live=false; eng.loaded=false;
+            eng.ev_end=true; pb_post();
+            break;
+        default:
+            eng.seg_live=false; eng.loaded=false;
+            break;
+        }
+        eng.segs.drop();
+    }
+}
+// music hook, audio thread: only copies, never blocks or allocates
+static void eng_mix(void*,Uint8 *stream,int len){
+    eng_segments();
+    uint64_t t0=eng.ring.tail.load(memory_order_relaxed);
+    if(eng.paused||!eng.seg_live){
+        if(eng.seg_live) clock_publish(eng.seg_pos0+(t0-eng.seg_at),0);
+        memset(stream,0,len);
+        return;
+    }
+    int done=0;
+    float vol=eng.vol/float(MIX_MAX_VOLUME);
+    while(done<len){
+        // stop exactly at the next segment so track changes are sample-accurate
+        size_t want=len-done;
+        if(Segment *s=eng.segs.peek())
+            want=min<uint64_t>(want,s->at-eng.ring.tail.load(memory_order_relaxed));
+        size_t n=eng.ring.read(stream+done,want);
+        pb_apply_gain(stream+done,n,eng.normalize?vol*eng.seg_gain:vol);
+        done+=n;
+        eng_segments();
+        if(!eng.seg_live) break;
+        if(!n){ ++eng.underruns; break; }
+    }
+    memset(stream+done,0,len-done);
+    // only frames of the current track that really went out count, so
+    // underruns and track switches inside this block don't skew the clock
+    if(eng.seg_live){
+        uint64_t from=max(t0,eng.seg_at);
+        clock_publish(eng.seg_pos0+(from-eng.seg_at),
+                      uint32_t(eng.ring.tail.load(memory_order_relaxed)-from));
+    }
+}
+
+// sample rate from the file header, 0 if unknown. covers what the native
+// rate profile needs: WAV, FLAC, Ogg Vorbis/Opus and MP3
+static int probe_rate(const fs::path &f){
+    ifstream in(f, ios::binary);
+    unsigned char b[4096];
+    in.read((char*)b, sizeof b);
+    size_t n = in.gcount();
+    auto le32 = [&](size_t i){ return b[i]|b[i+1]<<8|b[i+2]<<16|unsigned(b[i+3])<<24; };
+    if(n>=44&&!memcmp(b,"RIFF",4)&&!memcmp(b+8,"WAVE",4)){
+        for(size_t i=12;i+16<=n;i+=8+((le32(i+4)+1)&~1u))
+            if(!memcmp(b+i,"fmt ",4)) return le32(i+12);
+        return 0;
+    }
+    if(n>=21&&!memcmp(b,"fLaC",4))
+        return b[18]<<12|b[19]<<4|b[20]>>4;
+    if(n>=28&&!memcmp(b,"OggS",4)){
+        size_t p=27+b[26];
+        if(p+16<=n&&!memcmp(b+p,"\x01vorbis",7)) return le32(p+12);
+        if(p+8<=n&&!memcmp(b+p,"OpusHead",8)) return 48000;
+        return 0;
+    }
+    // mp3: skip an ID3v2 tag, then the first frame header
+    size_t off = 0;
+    if(n>=10&&!memcmp(b,"ID3",3)){
+        off = 10+((b[6]&0x7f)<<21|(b[7]&0x7f)<<14|(b[8]&0x7f)<<7|(b[9]&0x7f));
+        if(b[5]&0x10) off += 10;
+        in.clear(); in.seekg(off);
+        in.read((char*)b, sizeof b);
+        n = in.gcount();
+    }
+    static const int rates[4][3] = {
+        { 11025, 12000, 8000 }, {}, { 22050, 24000, 16000 }, { 44100, 48000, 32000 } };
+    for(size_t i=0;i+4<=n;++i){
+        if(b[i]!=0xff||(b[i+1]&0xe0)!=0xe0) continue;
+        int ver=(b[i+1]>>3)&3, layer=(b[i+1]>>1)&3, sr=(b[i+2]>>2)&3, br=b[i+2]>>4;
+        if(ver==1||!layer||sr==3||br==15) continue;
+        return rates[ver][sr];
+    }
+    return 0;
+}
+
+// what decoding f whole would take in the device format: the indexed or
+// tagged duration, else the size at a lossy 128 kbit/s, the worst case
+static uint64_t decoded_bytes(const IdxMap &m,const fs::path &f){
+    int ms=-1;
+    if(const IdxEntry *e=index_find(m,f)) ms=e->dur_ms;
+    TrackMeta t;
+    if(ms<=0&&meta_read(f,t)) ms=t.dur_ms;
+    uint64_t bps=uint64_t(eng.rate)*eng.frame_bytes;
+    if(ms>0) return uint64_t(ms)*bps/1000;
+    error_code ec;
+    uintmax_t sz=fs::file_size(f,ec);
+    return ec?UINT64_MAX:sz/16000*bps;
+}
+static uint64_t decoded_bytes(const fs::path &f){
+    fs::path dir=f.parent_path();
+    return decoded_bytes(IdxMap(dir,dir_mtime(dir)),f);
+}
+
+void gain_queue(const vector<uint32_t> &tracks);
+// linear gain for f: cached, from its tags, or measured on pcm when given
+// (device format). without any of those it is 1 and f is queued for the
+// background analysis
+static float track_gain(const fs::path &f,const Mix_Chunk *pcm){
+    float db, pk;
+    if(!index_gain(f,db,pk)){
+        if(rg_tags(f,db,pk)) index_note_gain(f,db,pk);
+        else if(pcm){
+            float lufs;
+            loudness(pcm->abuf,pcm->alen,eng.fmt,eng.rate,lufs,pk);
+            db=RG_REFERENCE-lufs;
+            index_note_gain(f,db,pk);
+        } else { gain_queue({ path_id(f.native()) }); return 1; }
+    }
+    float g=pow(10.f,db/20);
+    return pk>0?min(g,1/pk):g;   // never push the peak past full scale
+}
+
+// the loader's side of a job: every file read a track needs before the
+// feeder can use it
+static Decoded eng_load(const LoadJob &j){
+    Decoded d;
+    d.token=j.token; d.play=j.play;
+    if(j.dev_rate){
+        int r=probe_rate(j.f);
+        if(r>=8000&&r<=384000&&r!=j.dev_rate){
+            // a successor isn't decoded for another device, it streams
+            if(j.play) d.rate=r;
+            return d;
+        }
+    }
+    // decodes convert to the device format, keep it still meanwhile
+    shared_lock<shared_mutex> dl(eng.dev_m);
+    if(decoded_bytes(j.f)>DECODE_MAX_BYTES){
+        if(!j.play) return d;
+        dl.unlock();
+        d.music=music_open(j.f);
+        if(!d.music) return d;
+        d.gain=track_gain(j.f,nullptr);
+        if(!seek_load(j.f,d.seek)) seek_index_async(j.f);
+        return d;
+    }
+    SDL_RWops *rw=track_open(j.f,true);
+    d.pcm=rw?Mix_LoadWAV_RW(rw,1):nullptr;
+    if(d.pcm) d.gain=track_gain(j.f,d.pcm);
+    return d;
+}
+// loader thread: works through the jobs in turn
+static void eng_loader(){
+    unique_lock<mutex> lk(eng.m);
+    while(true){
+        eng.cv.wait(lk,[]{ return eng.quit||!eng.jobs.empty(); });
+        if(eng.quit) return;
+        LoadJob j=std::move(eng.jobs.front());
+        eng.jobs.pop_front();
+        unsigned g=eng.gen;
+        lk.unlock();
+        Decoded d=eng_load(j);
+        d.gen=g;
+        lk.lock();
+        eng.done.push_back(std::move(d));
+        eng_wake();
+    }
+}
+// play: start f once it's loaded; otherwise it replaces the successor
+static void eng_request(const fs::path &f,int token,bool play){
+    LoadJob j{ f, token, play, out_profiles[eng.profile].rate?0:eng.req_rate };
+    lock_guard<mutex> lk(eng.m);
+    if(play){ eng.jobs.push_front(std::move(j)); eng.cv.notify_one(); return; }
+    eng.jobs.erase(remove_if(eng.jobs.begin(),eng.jobs.end(),
+                             [](const LoadJob &x){ return !x.play; }),eng.jobs.end());
+    if(token>=0) eng.jobs.push_back(std::move(j));
+    eng.cv.notify_one();
+}
+// drop whatever the loader is doing or about to do
+static void eng_supersede(){
+    lock_guard<mutex> lk(eng.m);
+    ++eng.gen; eng.jobs.clear();
+}
+static void dec_free(Decoded &d){
+    if(d.pcm) Mix_FreeChunk(d.pcm);
+    if(d.music) Mix_FreeMusic(d.music);
+    d.pcm=nullptr; d.music=nullptr;
+}
+
+static void src_free(Src &s){ if(s.pcm) Mix_FreeChunk(s.pcm); s=Src{}; }
+static bool seg_push(Segment s){
+    s.at=eng.ring.head.load(memory_order_relaxed);
+    return eng.segs.push(s);
+}
+static Segment track_seg(const Src &s,bool fresh){
+    return { Segment::TRACK, fresh, s.token, 0, s.pos, s.pcm->alen, s.gain };
+}
+static void stream_halt(){
+    if(!eng.music) return;
+    Mix_HaltMusic(); Mix_FreeMusic(eng.music); eng.music=nullptr;
+    eng.loaded=false;
+}
+static void hook(bool on){
+    if(on==eng.hooked) return;
+    Mix_HookMusic(on?eng_mix:nullptr,nullptr);
+    eng.hooked=on;
+    if(on) return;
+    // the callback can't run any more, so drain what it left behind here
+    eng.segs.tail.store(eng.segs.head.load());
+    eng.ring.tail.store(eng.ring.head.load());
+    eng.seg_live=false;
+}
+// jump a streamed track to t seconds: through the seek index if it's ready,
+// reopening the file at the frame just before t so the decoder only walks
+// the last second; otherwise SDL_mixer walks from wherever it is
+static void stream_seek(double t){
+    SeekIndex &x=eng.stream_seek;
+    if(x.pts.empty()) seek_load(eng.stream_path,x);
+    if(!x.pts.empty()){
+        uint64_t want=uint64_t(t*x.rate);
+        auto it=upper_bound(x.pts.begin(),x.pts.end(),want,
+                            [](uint64_t v,const SeekPoint &p){ return v<p.sample; });
+        const SeekPoint &p=*(it==x.pts.begin()?it:it-1);
+        SDL_RWops *rw=splice_open(eng.stream_path,x.head_len,p.offset);
+        Mix_Music *m=rw?Mix_LoadMUS_RW(rw,1):nullptr;
+        if(m){
+            Mix_HaltMusic(); Mix_FreeMusic(eng.music);
+            eng.music=m;
+            Mix_PlayMusic(m,1);
+            if(eng.paused) Mix_PauseMusic();
+            eng.stream_base=double(p.sample)/x.rate;
+            if(t-eng.stream_base>0.01) Mix_SetMusicPosition(t-eng.stream_base);
+            return;
+        }
+    }
+    // an unspliced stream counts from the start of the file again
+    if(eng.stream_base>0){
+        Mix_Music *m=music_open(eng.stream_path);
+        if(!m) return;
+        Mix_HaltMusic(); Mix_FreeMusic(eng.music);
+        eng.music=m;
+        Mix_PlayMusic(m,1);
+        if(eng.paused) Mix_PauseMusic();
+        eng.stream_base=0;
+    }
+    Mix_SetMusicPosition(t);
+}
+// drop everything queued or playing
+static void eng_clear(){
+    stream_halt();
+    src_free(eng.feed); src_free(eng.after); src_free(eng.heard);
+    eng.ended=false; eng.queued_token=-1; eng.play_token=-1;
+    eng.fade_len=0;
+    eng.stream_over=false;
+    if(eng.hooked){
+        seg_push({ Segment::FLUSH });
+        seg_push({ Segment::STOP });
+    }
+    eng.paused=false;
+}
+
+// SDL_mixer's volume only matters for streamed tracks, which can only be
+// turned down; the hook path does volume and gain itself
+static void stream_volume(){
+    float g=eng.normalize?min(1.f,eng.stream_gain):1.f;
+    Mix_VolumeMusic(int(eng.vol*g));
+}
+// RBJ peaking biquads for the bands that do something at this rate, preamp
+// folded into the first
+static EqStage *eq_design(const Cmd &c,int rate){
+    EqStage *e=new EqStage{};
+    if(!c.token) return e;
+    float pre=pow(10.f,float(c.t)/20);
+    int lane=0;
+    auto band=[&](float b0,float b1,float b2,float a1,float a2){
+        EqPair &q=e->p[lane/2];
+        for(int k=lane%2*2;k<lane%2*2+2;++k){
+            q.b0[k]=b0*pre; q.b1[k]=b1*pre; q.b2[k]=b2*pre; q.a1[k]=a1; q.a2[k]=a2;
+        }
+        pre=1; ++lane;
+    };
+    for(int i=0;i<EQ_BANDS;++i){
+        if(fabs(c.eq[i])<0.05f||eq_freqs[i]>=0.45f*rate) continue;
+        double A=pow(10.0,c.eq[i]/40), w=2*M_PI*eq_freqs[i]/rate;
+        double al=sin(w)/(2*1.41), a0=1+al/A;
+        band(float((1+al*A)/a0),float(-2*cos(w)/a0),float((1-al*A)/a0),
+             float(-2*cos(w)/a0),float((1-al/A)/a0));
+    }
+    if(!lane&&pre!=1) band(1,0,0,0,0);      // preamp alone
+    if(lane%2) band(1,0,0,0,0);             // fill the last pair
+    e->n=(lane+1)/2;
+    return e;
+}
+// hand the wanted EQ to the postmix once it has taken the previous one
+static void eq_publish(){
+    EqStage *o;
+    while(eng.eq_old.pop(o)) delete o;
+    if(!eng.eq_dirty||eng.eq_next.load(memory_order_acquire)) return;
+    eng.eq_next.store(eq_design(eng.eq_want,eng.rate),memory_order_release);
+    eng.eq_dirty=false;
+}
+
+// (re)open the device. only the feeder calls this, with nothing playing;
+// --render opens it without hooks, its device thread never gets to them
+static void eng_open(int rate,Uint16 fmt,int frames,int buffer_ms,bool hooks=true){
+    hook(false);
+    eng_supersede();
+    eng.req_rate=rate; eng.req_fmt=fmt; eng.req_frames=frames;
+    eng.dev_want=true;
+    unique_lock<shared_mutex> dl(eng.dev_m);
+    {
+        lock_guard<mutex> lk(eng.dev_wm);
+        eng.dev_want=false;
+    }
+    eng.dev_cv.notify_all();
+    Mix_CloseAudio();
+    if(Mix_OpenAudio(rate,fmt,2,frames)<0)
+        Mix_OpenAudio(44100,MIX_DEFAULT_FORMAT,2,frames);   // keep some output
+    if(hooks){
+        Mix_HookMusicFinished(music_done);
+        Mix_SetPostMix(eng_postmix,nullptr);
+    }
+    eng.eq_dirty=true;      // redesigned for the new rate
+    stream_volume();
+    // SDL may have changed the spec, or the fallback opened: the mixer
+    // converts to whatever it got, so that's what the ring carries
+    int ch=2;
+    if(!Mix_QuerySpec(&eng.rate,&eng.fmt,&ch)){ eng.rate=44100; eng.fmt=AUDIO_S16SYS; }
+    eng.frame_bytes=SDL_AUDIO_BITSIZE(eng.fmt)/8*ch;
+    eng.buffer_ms=buffer_ms;
+    eng.latency_frames=frames;
+    eng.ring.init(size_t(eng.rate)*eng.frame_bytes*buffer_ms/1000);
+    clock_publish(0,0);
+}
+// the device the profile wants for a track at rate, 0 if it doesn't matter
+static void eng_configure(int rate){
+    const OutProfile &p=out_profiles[eng.profile];
+    if(p.rate) rate=p.rate;
+    if(!rate) rate=eng.req_rate;
+    int ms=p.buffer_ms?p.buffer_ms:eng.want_buffer_ms;
+    // against the request, not the device: a fallback would reopen forever
+    if(rate!=eng.req_rate||p.fmt!=eng.req_fmt||p.frames!=eng.req_frames||ms!=eng.buffer_ms)
+        eng_open(rate,p.fmt,p.frames,ms);
+}
+static void eng_command(Cmd &c){
+    switch(c.op){
+    case Cmd::PLAY:
+        eng_clear();
+        eng_supersede();
+        eng_configure(0);       // a new profile or buffer; the rate is the loader's
+        eng.play_path=c.f; eng.play_token=c.token;
+        eng_request(c.f,c.token,true);
+        break;
+    case Cmd::QUEUE: {
+        if(c.token==eng.queued_token) break;
+        eng.queued_token=c.token;
+        src_free(eng.after);
+        eng.queued_path=c.f;
+        eng_request(c.f,c.token,false);
+        break;
+    }
+    case Cmd::PAUSE:
+    case Cmd::RESUME: {
+        bool p=(c.op==Cmd::PAUSE);
+        if(eng.music){ if(p) Mix_PauseMusic(); else Mix_ResumeMusic(); }
+        eng.paused=p;
+        break;
+    }
+    case Cmd::SEEK: {
+        eng.fade_len=0;     // a seek cuts a crossfade short
+        if(eng.music){
+            stream_seek(max(0.0,c.t));
+            clock_publish(uint64_t(c.t*eng.rate)*eng.frame_bytes,0);
+            break;
+        }
+        // seek what is being heard, which may be behind what is being fed
+        int heard=eng.cur_token;
+        if(eng.heard.pcm&&eng.heard.token==heard&&eng.feed.token!=heard){
+            src_free(eng.after);
+            eng.after=eng.feed; eng.after.pos=0;
+            eng.queued_token=eng.after.token;
+            eng.feed=eng.heard; eng.heard=Src{};
+        }
+        if(!eng.feed.pcm||eng.feed.token!=heard) break;
+        uint32_t b=uint32_t(max(0.0,c.t)*eng.rate)*eng.frame_bytes;
+        eng.feed.pos=min(b,eng.feed.pcm->alen);
+        eng.ended=false;
+        seg_push({ Segment::FLUSH });
+        seg_push(track_seg(eng.feed,false));
+        break;
+    }
+    case Cmd::VOLUME:
+        stream_volume();
+        break;
+    case Cmd::NORMALIZE:
+        eng.normalize=c.t!=0;
+        stream_volume();
+        break;
+    case Cmd::FADE:
+        eng.fade_ms=int(c.t);
+        eng.fade_curve=c.token;
+        eng.fade_len=0;     // a fade under way finishes as a cut
+        break;
+    case Cmd::EQ:
+        eng.eq_want=c;
+        eng.eq_dirty=true;
+        break;
+    case Cmd::OUTPUT:
+        eng.profile=c.token;
+        eng.want_buffer_ms=int(c.t);
+        break;
+    case Cmd::STOP:
+        eng_clear();
+        eng_supersede();
+        break;
+    }
+}
+
+// a PLAY the loader is done with: decoded it goes out through the hook,
+// too long it streams, for another rate the device reopens and it's loaded
+// again
+static void eng_start(Decoded &x){
+    eng.play_token=-1;
+    if(x.rate){
+        eng_configure(x.rate);
+        eng.play_token=x.token;
+        eng_request(eng.play_path,x.token,true);
+        // the reopen dropped the successor's job too
+        if(eng.queued_token>=0) eng_request(eng.queued_path,eng.queued_token,false);
+        return;
+    }
+    if(x.pcm){
+        hook(true);
+        eng.feed={ x.pcm, x.token, 0, x.gain };
+        x.pcm=nullptr;
+        eng.ended=false; eng.fade_len=0;
+        seg_push(track_seg(eng.feed,true));
+        return;
+    }
+    if(!x.music){ eng.ev_fail=true; pb_post(); return; }
+    hook(false);
+    eng.music=x.music; x.music=nullptr;
+    eng.stream_gain=x.gain;
+    stream_volume();
+    Mix_PlayMusic(eng.music,1);
+    if(eng.paused) Mix_PauseMusic();
+    eng.stream_path=eng.play_path;
+    eng.stream_base=0;
+    eng.stream_seek=std::move(x.seek);
+    eng.cur_token=x.token;
+    clock_publish(0,0);
+    eng.len_bytes=uint64_t(Mix_MusicDuration(eng.music)*eng.rate)*eng.frame_bytes;
+    eng.loaded=true;
+    eng.ev_started=x.token; pb_post();
+}
+// tracks coming back from the loader
+static void eng_collect(){
+    vector<Decoded> d;
+    {
+        lock_guard<mutex> lk(eng.m);
+        d.swap(eng.done);
+    }
+    for(auto &x:d){
+        // superseded, or converted for a device that has been reopened
+        // since, maybe by a PLAY earlier in this batch. gen is only
+        // changed by the feeder
+        if(x.gen!=eng.gen){ dec_free(x); continue; }
+        if(x.play){
+            if(x.token==eng.play_token) eng_start(x);
+            dec_free(x);
+            continue;
+        }
+        // a stale or failed successor just doesn't get queued; the
+        // current track then ends normally and the UI moves on
+        if(!x.pcm||x.token!=eng.queued_token){
+            if(x.pcm) Mix_FreeChunk(x.pcm);
+            if(x.token==eng.queued_token) eng.queued_token=-1;
+            continue;
+        }
+        src_free(eng.after);
+        eng.after={ x.pcm, x.token, 0, x.gain };
+    }
+}
+// a stream ran out: its decoded successor goes on through the hook, or,
+// with none coming, the UI hears END
+static void stream_handover(){
+    if(eng.after.pcm){
+        stream_halt();
+        hook(true);
+        eng.feed=eng.after; eng.after=Src{};
+        eng.queued_token=-1;
+        eng.ended=false; eng.fade_len=0;
+        seg_push(track_seg(eng.feed,true));
+    } else if(eng.queued_token>=0) return;     // still decoding
+    else { stream_halt(); eng.ev_end=true; pb_post(); }
+    eng.stream_over=false;
+}
+
+// mix n bytes of the outgoing track (heard, from fade_at) into p, which
+// holds feed's bytes from `pos` on, both in device format
+static void fade_mix(Uint8 *p,size_t n,uint32_t pos){
+    const Uint8 *o=eng.heard.pcm->abuf+eng.fade_at+pos;
+    // the callback levels with the incoming track's gain only
+    float k=eng.normalize&&eng.feed.gain>0?eng.heard.gain/eng.feed.gain:1;
+    int ch=eng.fmt==AUDIO_F32SYS?eng.frame_bytes/4:eng.frame_bytes/2;
+    size_t frames=n/eng.frame_bytes;
+    double x0=double(pos/eng.frame_bytes), len=double(eng.fade_len/eng.frame_bytes);
+    for(size_t i=0;i<frames;++i){
+        float x=float((x0+i)/len), gi, go;
+        switch(eng.fade_curve){
+        case 1:  gi=x; go=1-x; break;
+        case 2:  gi=0.5f-0.5f*cos(float(M_PI)*x); go=1-gi; break;
+        default: gi=sin(float(M_PI_2)*x); go=cos(float(M_PI_2)*x); break;
+        }
+        go*=k;
+        for(int c=0;c<ch;++c){
+            size_t j=i*ch+c;
+            if(eng.fmt==AUDIO_F32SYS)
+                ((float*)p)[j]=((float*)p)[j]*gi+((const float*)o)[j]*go;
+            else
+                ((Sint16*)p)[j]=Sint16(clamp(lrintf(((Sint16*)p)[j]*gi+((const Sint16*)o)[j]*go),-32768L,32767L));
+        }
+    }
+}
+
+// top the ring up from feed, moving on to `after` when feed runs out, or
+// fading over to it fade_ms before that
+static void eng_fill(){
+    uint32_t fb=uint32_t(uint64_t(eng.fade_ms)*eng.rate/1000)*eng.frame_bytes;
+    while(eng.feed.pcm){
+        Src &f=eng.feed;
+        if(fb&&eng.after.pcm&&!eng.ended&&f.pos>=eng.fade_len&&f.pcm->alen-min(f.pos,f.pcm->alen)<=fb){
+            // a successor decoded late just gets a shorter fade
+            uint32_t n=min(f.pcm->alen-f.pos,eng.after.pcm->alen);
+            n-=n%eng.frame_bytes;
+            if(n){
+                if(!seg_push(track_seg(eng.after,true))) return;
+                src_free(eng.heard);
+                eng.heard=f; f=eng.after; eng.after=Src{};
+                eng.fade_at=eng.heard.pos; eng.fade_len=n;
+                eng.queued_token=-1;
+                continue;
+            }
+        }
+        if(f.pos>=f.pcm->alen){
+            if(eng.after.pcm&&!eng.ended){
+                Segment s=track_seg(eng.after,true);
+                if(!seg_push(s)) return;
+                src_free(eng.heard);
+                eng.heard=f; f=eng.after; eng.after=Src{};
+                eng.fade_len=0;     // a plain handoff mixes nothing in
+                eng.queued_token=-1;
+                eng.ended=false;
+                continue;
+            }
+            // successor still decoding: wait for it rather than end
+            if(eng.queued_token>=0||eng.ended) return;
+            if(seg_push({ Segment::END })) eng.ended=true;
+            return;
+        }
+        size_t n=min<size_t>(eng.ring.space(),f.pcm->alen-f.pos);
+        if(f.pos<eng.fade_len) n=min<size_t>(n,eng.fade_len-f.pos);
+        // don't run past where the fade should start while a successor is coming
+        else if(fb&&(eng.after.pcm||eng.queued_token>=0)&&f.pos+fb<f.pcm->alen)
+            n=min<size_t>(n,f.pcm->alen-fb-f.pos);
+        n-=n%eng.frame_bytes;
+        if(!n) return;
+        if(f.pos<eng.fade_len){
+            eng.fade_buf.assign(f.pcm->abuf+f.pos,f.pcm->abuf+f.pos+n);
+            fade_mix(eng.fade_buf.data(),n,f.pos);
+            eng.ring.write(eng.fade_buf.data(),n);
+        } else
+            eng.ring.write(f.pcm->abuf+f.pos,n);
+        f.pos+=n;
+    }
+}
+
+static void eng_feeder(){
+    int period=max(5,eng.buffer_ms/4);
+    while(true){
+        Cmd c;
+        while(eng.cmds.pop(c)) eng_command(c);
+        {
+            lock_guard<mutex> lk(eng.m);
+            if(eng.quit) return;
+        }
+        eng_collect();
+        // Mix_HaltMusic runs the finished hook too, only a real end counts
+        if(eng.stream_done.exchange(false)&&eng.music&&!Mix_PlayingMusic())
+            eng.stream_over=true;
+        if(eng.stream_over) stream_handover();
+        eng_fill();
+        eq_publish();
+        // streamed tracks: SDL_mixer's decoder position, interpolated over
+        // one poll period like a callback block
+        if(eng.music)
+            clock_publish(uint64_t((eng.stream_base+Mix_GetMusicPosition(eng.music))*eng.rate)*eng.frame_bytes,
+                          eng.paused||!Mix_PlayingMusic()?0:
+                          uint32_t(uint64_t(eng.rate)*eng.frame_bytes*period/1000));
+        // refill at a quarter of the buffer while something is playing, and
+        // look again while the postmix has an EQ swap to take or hand back
+        bool busy=eng.feed.pcm||eng.music||eng.eq_dirty
+                  ||eng.eq_next.load(memory_order_acquire)||eng.eq_old.peek();
+        struct pollfd pf={ eng.wake_fd, POLLIN, 0 };
+        if(poll(&pf,1,busy?period:-1)>0){
+            uint64_t n;
+            ssize_t r=read(eng.wake_fd,&n,sizeof n); (void)r;
+        }
+    }
+}
+
+// opens the device for the profile; native rate starts at 44.1 kHz and
+// follows the tracks from there
+void pb_init(int profile,int buffer_ms){
+    const OutProfile &p=out_profiles[profile];
+    eng.profile=profile;
+    eng.want_buffer_ms=buffer_ms;
+    eng_open(p.rate?p.rate:44100,p.fmt,p.frames,p.buffer_ms?p.buffer_ms:buffer_ms);
+    eng.wake_fd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    eng.loader=thread(eng_loader);
+    eng.feeder=thread(eng_feeder);
+}
+void pb_shutdown(){
+    {
+        lock_guard<mutex> lk(eng.m);
+        eng.quit=true;
+        eng.cv.notify_one();
+    }
+    eng_wake();
+    eng.loader.join(); eng.feeder.join();
+    hook(false);
+    stream_halt();
+    src_free(eng.feed); src_free(eng.after); src_free(eng.heard);
+    for(auto &x:eng.done) dec_free(x);
+    eng.done.clear();
+    Mix_CloseAudio();
+    delete eng.eq; delete eng.eq_next.exchange(nullptr);
+    EqStage *o;
+    while(eng.eq_old.pop(o)) delete o;
+    close(eng.wake_fd);
+}
+
+static void pb_cmd(Cmd c){
+    // the queue only fills up if the feeder is stuck; then it waits its turn
+    while(!eng.cmds.push(c)) this_thread::yield();
+    eng_wake();
+}
+bool pb_loaded(){ return eng.loaded; }
+// start f now. PB_STARTED follows once it is decoded, PB_FAILED if it can't be
+void pb_play(const fs::path &f,int token){ pb_cmd({ Cmd::PLAY, f, token }); }
+// decode f ahead as the gapless successor of what's playing; -1 clears it
+void pb_queue(const fs::path &f,int token){ pb_cmd({ Cmd::QUEUE, f, token }); }
+void pb_stop(){ eng.loaded=false; pb_cmd({ Cmd::STOP }); }
+void pb_pause(bool p){ pb_cmd({ p?Cmd::PAUSE:Cmd::RESUME }); }
+void pb_seek(double s){ pb_cmd({ Cmd::SEEK, {}, -1, s }); }
+// loudness levelling on or off, takes effect right away
+void pb_normalize(bool on){ pb_cmd({ Cmd::NORMALIZE, {}, -1, double(on) }); }
+// equalizer band gains in dB (null turns it off) and preamp, takes effect
+// within a device buffer
+void pb_eq(const float *db,int preamp_db){
+    Cmd c{ Cmd::EQ, {}, db!=nullptr, double(preamp_db) };
+    if(db) copy(db,db+EQ_BANDS,c.eq.begin());
+    pb_cmd(std::move(c));
+}
+// overlap consecutive tracks by ms (0: gapless or not, as queued) with
+// curve from fade_curves; needs the successor queued with pb_queue
+void pb_crossfade(int ms,int curve){ pb_cmd({ Cmd::FADE, {}, curve, double(ms) }); }
+// new output profile and buffer size, applied when the next track starts
+void pb_output(int profile,int buffer_ms){ pb_cmd({ Cmd::OUTPUT, {}, profile, double(buffer_ms) }); }
+// seconds of the track actually heard: frames delivered by the audio path,
+// minus what still sits in the device buffer, advanced to now within the
+// last delivered block
+double pb_position(){
+    uint64_t pos; uint32_t n; int64_t ns; unsigned q;
+    do {
+        q=eng.clk_seq.load(memory_order_acquire);
+        pos=eng.clk_pos.load(memory_order_relaxed);
+        n=eng.clk_n.load(memory_order_relaxed);
+        ns=eng.clk_ns.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while((q&1)||q!=eng.clk_seq.load(memory_order_relaxed));
+    double f=double(pos/eng.frame_bytes)
+            +min(double(n/eng.frame_bytes),(now_ns()-ns)*1e-9*eng.rate)
+            -eng.latency_frames;
+    return max(0.0,f/eng.rate);
+}
+double pb_duration(){ return double(eng.len_bytes)/eng.frame_bytes/eng.rate; }
+void pb_volume(int pct){
+    eng.vol=pct*MIX_MAX_VOLUME/100;
+    pb_cmd({ Cmd::VOLUME });
+}
+// next thing that happened, call until PB_NONE after done_fd fires
+PbEvent pb_event(int &token){
+    if((token=eng.ev_started.exchange(-1))>=0) return PB_STARTED;
+    if(eng.ev_fail.exchange(false)) return PB_FAILED;
+    if(eng.ev_end.exchange(false)) return PB_ENDED;
+    return PB_NONE;
+}
+
+// spectrum
+// the UI's side of the tap: the newest output downmixed to mono and
+// decimated to about 22 kHz, Hann-windowed, through a radix-2 FFT and
+// binned into log-spaced bars. runs on the UI thread at its frame rate
+static const int SPEC_N = 1024;
+static struct Spectrum {
+    int   rev[SPEC_N];
+    float wr[SPEC_N], wi[SPEC_N];   // twiddles, the stage of half size h at h-1
+    float win[SPEC_N];
+    float re[SPEC_N], im[SPEC_N];
+    bool  ready = false;
+} spec;
+
+static void fft_init(){
+    for(int i=0,j=0;i<SPEC_N;++i){
+        spec.rev[i]=j;
+        int b=SPEC_N>>1;
+        while(j&b){ j^=b; b>>=1; }
+        j|=b;
+    }
+    for(int h=1;h<SPEC_N;h<<=1)
+        for(int j=0;j<h;++j){
+            spec.wr[h-1+j]=float(cos(M_PI*j/h));
+            spec.wi[h-1+j]=float(-sin(M_PI*j/h));
+        }
+    for(int i=0;i<SPEC_N;++i) spec.win[i]=float(0.5-0.5*cos(2*M_PI*i/SPEC_N));
+    spec.ready=true;
+}
+// in place, split real/imaginary; butterflies 4 at a time once a stage is
+// that wide
+static void fft(float *re,float *im){
+    for(int i=0;i<SPEC_N;++i)
+        if(i<spec.rev[i]){ swap(re[i],re[spec.rev[i]]); swap(im[i],im[spec.rev[i]]); }
+    for(int h=1;h<SPEC_N;h<<=1){
+        const float *cr=spec.wr+h-1, *ci=spec.wi+h-1;
+        for(int k=0;k<SPEC_N;k+=2*h){
+            float *ar=re+k, *ai=im+k, *br=re+k+h, *bi=im+k+h;
+            int j=0;
+#if defined(__SSE2__)
+            for(;j+4<=h;j+=4){
+                __m128 wr=_mm_loadu_ps(cr+j), wi=_mm_loadu_ps(ci+j);
+                __m128 xr=_mm_loadu_ps(br+j), xi=_mm_loadu_ps(bi+j);
+                __m128 tr=_mm_sub_ps(_mm_mul_ps(xr,wr),_mm_mul_ps(xi,wi));
+                __m128 ti=_mm_add_ps(_mm_mul_ps(xr,wi),_mm_mul_ps(xi,wr));
+                __m128 ur=_mm_loadu_ps(ar+j), ui=_mm_loadu_ps(ai+j);
+                _mm_storeu_ps(br+j,_mm_sub_ps(ur,tr)); _mm_storeu_ps(bi+j,_mm_sub_ps(ui,ti));
+                _mm_storeu_ps(ar+j,_mm_add_ps(ur,tr)); _mm_storeu_ps(ai+j,_mm_add_ps(ui,ti));
+            }
+#elif defined(__ARM_NEON)
+            for(;j+4<=h;j+=4){
+                float32x4_t wr=vld1q_f32(cr+j), wi=vld1q_f32(ci+j);
+                float32x4_t xr=vld1q_f32(br+j), xi=vld1q_f32(bi+j);
+                float32x4_t tr=vmlsq_f32(vmulq_f32(xr,wr),xi,wi);
+                float32x4_t ti=vmlaq_f32(vmulq_f32(xr,wi),xi,wr);
+                float32x4_t ur=vld1q_f32(ar+j), ui=vld1q_f32(ai+j);
+                vst1q_f32(br+j,vsubq_f32(ur,tr)); vst1q_f32(bi+j,vsubq_f32(ui,ti));
+                vst1q_f32(ar+j,vaddq_f32(ur,tr)); vst1q_f32(ai+j,vaddq_f32(ui,ti));
+            }
+#endif
+            for(;j<h;++j){
+                float tr=br[j]*cr[j]-bi[j]*ci[j], ti=br[j]*ci[j]+bi[j]*cr[j];
+                br[j]=ar[j]-tr; bi[j]=ai[j]-ti;
+                ar[j]+=tr; ai[j]+=ti;
+            }
+        }
+    }
+}
+// spectrum output is only copied while this is on
+void pb_tap(bool on){ eng.tap_on=on; }
+// nb bars from 40 Hz up, in dB below full scale, from what was output last;
+// false if nothing new has come out since the previous call
+bool pb_spectrum(float *bars,int nb){
+    const TapBlock *b=eng.tap.take();
+    if(!b||nb<=0) return false;
+    if(!spec.ready) fft_init();
+    int d=clamp(b->rate/22050,1,4), fb=b->frame_bytes, ch=b->fmt==AUDIO_F32SYS?fb/4:fb/2;
+    int frames=b->len/fb, start=frames-SPEC_N*d;
+    float k=1.f/(d*ch);
+    if(b->fmt!=AUDIO_F32SYS) k/=32768;
+    for(int i=0;i<SPEC_N;++i){
+        float x=0;
+        for(int f=start+i*d,e=f+d;f<e;++f){
+            if(f<0) continue;
+            for(int c=0;c<ch;++c)
+                x+=b->fmt==AUDIO_F32SYS?((const float*)b->pcm)[f*ch+c]:((const Sint16*)b->pcm)[f*ch+c];
+        }
+        spec.re[i]=x*k*spec.win[i];
+        spec.im[i]=0;
+    }
+    fft(spec.re,spec.im);
+    // a full-scale sine peaks at N/4 through the Hann window
+    double fsz=double(b->rate)/d, lo=40, hi=min(16000.0,fsz/2), norm=16.0/(double(SPEC_N)*SPEC_N);
+    for(int i=0;i<nb;++i){
+        int b0=int(lo*pow(hi/lo,double(i)/nb)*SPEC_N/fsz);
+        int b1=int(lo*pow(hi/lo,double(i+1)/nb)*SPEC_N/fsz);
+        b1=min(max(b1,b0+1),SPEC_N/2);
+        float p=0;
+        for(int j=b0;j<b1;++j) p=max(p,spec.re[j]*spec.re[j]+spec.im[j]*spec.im[j]);
+        bars[i]=float(10*log10(max(1e-12,p*norm)));
+    }
+    return true;
+}
+
+// loudness analysis
+// a small pool of low-priority threads works through tracks that have no
+// gain yet: tags first, a full decode and R128 measurement only when there
+// are none. each track is looked at once per run
+static const uint64_t GAIN_POOL_BYTES = 256u<<20;
+static struct GainPool {
+    mutex    m;
+    condition_variable cv;
+    deque<fs::path> todo;
+    unordered_set<uint32_t> seen;   // path ids
+    vector<thread> pool;
+    bool     quit = false;
+} gp;
+
+static void gain_worker(){
+    setpriority(PRIO_PROCESS,gettid(),10);
+    // tracks come a directory at a time, so its index stays mapped until
+    // the next one, or until something rewrites it
+    unique_ptr<IdxMap> idx;
+    fs::path idx_dir;
+    int64_t  idx_mt = 0;
+    unsigned idx_gen = 0;
+    unique_lock<mutex> lk(gp.m);
+    while(true){
+        gp.cv.wait(lk,[]{ return gp.quit||!gp.todo.empty(); });
+        if(gp.quit) return;
+        fs::path f=std::move(gp.todo.front());
+        gp.todo.pop_front();
+        lk.unlock();
+        fs::path dir=f.parent_path();
+        int64_t mt=dir_mtime(dir);
+        if(!idx||dir!=idx_dir||mt!=idx_mt||index_gen!=idx_gen){
+            idx_gen=index_gen;
+            idx.reset();
+            idx=make_unique<IdxMap>(dir,mt);
+            idx_dir=dir; idx_mt=mt;
+        }
+        float db, pk;
+        if(!index_gain(*idx,f,db,pk)){
+            if(rg_tags(f,db,pk)) index_note_gain(f,db,pk);
+            else if(decoded_bytes(*idx,f)<=DECODE_MAX_BYTES){
+                // same decode as playback, so the device format can't
+                // change under it. a pending reopen goes first, and the
+                // measuring runs on the format the decode got
+                {
+                    unique_lock<mutex> wl(eng.dev_wm);
+                    eng.dev_cv.wait(wl,[]{ return !eng.dev_want; });
+                }
+                shared_lock<shared_mutex> dl(eng.dev_m);
+                SDL_RWops *rw=track_open(f,true);
+                Mix_Chunk *c=rw?Mix_LoadWAV_RW(rw,1):nullptr;
+                Uint16 fmt=eng.fmt; int rate=eng.rate;
+                dl.unlock();
+                if(c){
+                    float lufs;
+                    loudness(c->abuf,c->alen,fmt,rate,lufs,pk);
+                    Mix_FreeChunk(c);
+                    index_note_gain(f,RG_REFERENCE-lufs,pk);
+                }
+            }
+        }
+        lk.lock();
+    }
+}
+void gain_queue(const vector<uint32_t> &tracks){
+    lock_guard<mutex> lk(gp.m);
+    if(gp.quit) return;
+    for(uint32_t f:tracks)
+        if(gp.seen.insert(f).second) gp.todo.push_back(path_of(f));
+    // every decode holds a whole track: as many as fit GAIN_POOL_BYTES
+    int n=clamp(int(GAIN_POOL_BYTES/DECODE_MAX_BYTES),1,max(1,int(thread::hardware_concurrency())));
+    while((int)gp.pool.size()<n) gp.pool.emplace_back(gain_worker);
+    gp.cv.notify_all();
+}
+void gain_stop(){
+    {
+        lock_guard<mutex> lk(gp.m);
+        gp.quit=true;
+        gp.cv.notify_all();
+    }
+    for(auto &t:gp.pool) t.join();
+    gp.pool.clear();
+}
+
+// offline render
+// `fmus --render <files, dirs or .m3u> [--out file.wav]` runs the decoded
+// side of playback without a sound card and as fast as it goes: the
+// loader's decode and gain, the feeder's gapless/crossfade fill, the
+// callback's mix and the postmix EQ, called in turn on this thread. every
+// track goes through it like a pre-decoded successor; ones over
+// DECODE_MAX_BYTES, which the player would stream, are skipped and
+// counted in the summary. without --out the result is thrown away, so the
+// run is a benchmark; either way the stats go to stdout. allocation
+// counts need -DFMUS_ALLOC_STATS, which replaces the global operator new
+// for the whole program
+static atomic<uint64_t> new_calls{0};
+#ifdef FMUS_ALLOC_STATS
+// the array forms forward to these
+void *operator new(size_t n){
+    new_calls.fetch_add(1,memory_order_relaxed);
+    if(void *p=malloc(n?n:1)) return p;
+    throw bad_alloc();
+}
+void *operator new(size_t n,align_val_t a){
+    new_calls.fetch_add(1,memory_order_relaxed);
+    size_t al=max(size_t(a),sizeof(void*));
+    if(void *p=aligned_alloc(al,(max<size_t>(n,1)+al-1)/al*al)) return p;
+    throw bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p,size_t) noexcept { free(p); }
+void operator delete(void *p,align_val_t) noexcept { free(p); }
+void operator delete(void *p,size_t,align_val_t) noexcept { free(p); }
+static const bool alloc_stats = true;
+#else
+static const bool alloc_stats = false;
+#endif
+static string alloc_str(uint64_t n){ return alloc_stats?to_string(n):"n/a"; }
+
+// a directory renders its tracks in listing order, an .m3u its entries
+static void render_expand(const fs::path &p,vector<fs::path> &out){
+    error_code ec;
+    if(fs::is_directory(p,ec)){
+        for(auto &e:list_items(p)) if(!e.dir()) out.push_back(e.path());
+        return;
+    }
+    string ext=p.extension().string();
+    transform(ext.begin(),ext.end(),ext.begin(),::tolower);
+    if(ext!=".m3u"&&ext!=".m3u8"){ out.push_back(p); return; }
+    ifstream in(p);
+    string line;
+    while(getline(in,line)){
+        if(!line.empty()&&line.back()=='\r') line.pop_back();
+        if(line.empty()||line[0]=='#') continue;
+        fs::path t(line);
+        out.push_back(t.is_absolute()?t:p.parent_path()/t);
+    }
+}
+
+// WAV header for n data bytes of the device format, 80 bytes either way:
+// past 4 GB the file becomes RF64 and its JUNK chunk the ds64 sizes
+static void wav_header(ofstream &o,uint64_t n){
+    bool fl=eng.fmt==AUDIO_F32SYS, big=n+72>UINT32_MAX;
+    int ch=eng.frame_bytes/(SDL_AUDIO_BITSIZE(eng.fmt)/8);
+    auto u64=[&](uint64_t v){ o.write((const char*)&v,8); };
+    auto u32=[&](uint32_t v){ o.write((const char*)&v,4); };
+    auto u16=[&](uint16_t v){ o.write((const char*)&v,2); };
+    o.write(big?"RF64":"RIFF",4); u32(big?UINT32_MAX:uint32_t(72+n)); o.write("WAVE",4);
+    o.write(big?"ds64":"JUNK",4); u32(28);
+    u64(72+n); u64(n); u64(n/eng.frame_bytes); u32(0);
+    o.write("fmt ",4);
+    u32(16); u16(fl?3:1); u16(ch); u32(eng.rate);
+    u32(eng.rate*eng.frame_bytes); u16(eng.frame_bytes); u16(SDL_AUDIO_BITSIZE(eng.fmt));
+    o.write("data",4); u32(big?UINT32_MAX:uint32_t(n));
+}
+
+static int render(const vector<fs::path> &tracks,const fs::path &out){
+    if(tracks.empty()){ fprintf(stderr,"fmus: nothing to render\n"); return 1; }
+    SDL_setenv("SDL_AUDIODRIVER","dummy",1);
+    SDL_Init(SDL_INIT_AUDIO);
+    const OutProfile &pr=out_profiles[settings.output_profile];
+    int rate=pr.rate?pr.rate:probe_rate(tracks[0]);
+    eng_open(rate>=8000?rate:44100,pr.fmt,pr.frames,500,false);
+    eng.normalize=settings.normalize;
+    eng.fade_ms=settings.crossfade_ms; eng.fade_curve=settings.crossfade_curve;
+    eng.eq_want=Cmd{ Cmd::EQ, {}, eq_gains()!=nullptr, double(settings.eq_preamp) };
+    if(const float *g=eq_gains()) copy(g,g+EQ_BANDS,eng.eq_want.eq.begin());
+    eq_publish();
+
+    ofstream o;
+    if(!out.empty()){
+        o.open(out,ios::binary);
+        if(!o){ fprintf(stderr,"fmus: can't write %s\n",out.c_str()); return 1; }
+        wav_header(o,0);
+    }
+
+    struct Stat { int files = 0, failed = 0, skipped = 0; uintmax_t bytes = 0; double audio = 0, secs = 0; uint64_t allocs = 0; };
+    map<string,Stat> fmts;
+    double dec_s = 0, mix_s = 0;
+    uint64_t mix_allocs = 0;
+    size_t next = 0;
+    // the loader's part: decode whole, then gain
+    auto load = [&]() -> Src {
+        while(next<tracks.size()){
+            const fs::path &f=tracks[next];
+            string ext=f.extension().string();
+            transform(ext.begin(),ext.end(),ext.begin(),::tolower);
+            Stat &st=fmts[ext.empty()?"?":ext.substr(1)];
+            if(decoded_bytes(f)>DECODE_MAX_BYTES){
+                ++next; ++st.skipped;
+                fprintf(stderr,"fmus: %s is too long to decode whole, the player streams it\n",f.c_str());
+                continue;
+            }
+            uint64_t a0=new_calls;
+            int64_t t0=now_ns();
+            SDL_RWops *rw=track_open(f,true);
+            Mix_Chunk *c=rw?Mix_LoadWAV_RW(rw,1):nullptr;
+            double dt=(now_ns()-t0)*1e-9;
+            st.allocs+=new_calls-a0;
+            st.secs+=dt; dec_s+=dt;
+            int tok=int(next++);
+            if(!c){ ++st.failed; fprintf(stderr,"fmus: can't decode %s\n",f.c_str()); continue; }
+            ++st.files;
+            int64_t mt; uint64_t sz;
+            if(file_stamp(f,mt,sz)) st.bytes+=sz;
+            st.audio+=double(c->alen)/eng.frame_bytes/eng.rate;
+            return { c, tok, 0, settings.normalize?track_gain(f,c):1.f };
+        }
+        return {};
+    };
+
+    int64_t t_start=now_ns();
+    eng.feed=load();
+    if(!eng.feed.pcm){ fprintf(stderr,"fmus: nothing to render\n"); return 1; }
+    seg_push(track_seg(eng.feed,true));
+    vector<Uint8> blk(size_t(eng.latency_frames)*eng.frame_bytes);
+    uint64_t written=0;
+    while(true){
+        // successor ready before the feeder would wait for it
+        if(!eng.after.pcm&&eng.queued_token<0&&next<tracks.size()){
+            eng.after=load();
+            eng.queued_token=eng.after.pcm?eng.after.token:-1;
+        }
+        uint64_t a0=new_calls;
+        int64_t t0=now_ns();
+        uint64_t tail=eng.ring.tail.load();
+        eng_fill();
+        eng_mix(nullptr,blk.data(),int(blk.size()));
+        eng_postmix(nullptr,blk.data(),int(blk.size()));
+        size_t n=size_t(eng.ring.tail.load()-tail);  // the rest is padding
+        mix_s+=(now_ns()-t0)*1e-9;
+        mix_allocs+=new_calls-a0;
+        if(o.is_open()) o.write((const char*)blk.data(),n);
+        written+=n;
+        if(eng.ev_end.exchange(false)) break;
+    }
+    double total=(now_ns()-t_start)*1e-9;
+    if(o.is_open()){
+        o.seekp(0);
+        wav_header(o,written);
+    }
+    src_free(eng.feed); src_free(eng.after); src_free(eng.heard);
+    Mix_CloseAudio();
+    SDL_Quit();
+
+    double audio=double(written)/eng.frame_bytes/eng.rate;
+    struct rusage ru{};
+    getrusage(RUSAGE_SELF,&ru);
+    printf("rendered %.1f s of audio at %d Hz %s in %.2f s: %.1fx realtime\n",
+           audio,eng.rate,eng.fmt==AUDIO_F32SYS?"f32":"s16",total,audio/max(total,1e-9));
+    printf("  decode %.2f s, mix+dsp %.3f s (%.0fx realtime)\n",dec_s,mix_s,audio/max(mix_s,1e-9));
+    int skipped=0;
+    for(auto &[ext,st]:fmts){
+        string bad;
+        if(st.failed)  bad+=", "+to_string(st.failed)+" failed";
+        if(st.skipped) bad+=", "+to_string(st.skipped)+" too long";
+        if(!bad.empty()) bad=" ("+bad.substr(2)+")";
+        skipped+=st.skipped;
+        printf("  %-5s %3d files%s, %7.1f MB, %8.1f s audio in %6.2f s: %7.1fx realtime, %6.1f MB/s, %s allocations\n",
+               ext.c_str(),st.files,bad.c_str(),
+               st.bytes/1048576.0,st.audio,st.secs,st.audio/max(st.secs,1e-9),
+               st.bytes/1048576.0/max(st.secs,1e-9),alloc_str(st.allocs).c_str());
+    }
+    if(skipped)
+        printf("  %d track%s over the %llu MB decode bound left out, the player streams those\n",
+               skipped,skipped==1?"":"s",(unsigned long long)(DECODE_MAX_BYTES>>20));
+    printf("  mix loop allocations: %s, peak RSS %ld MB\n",alloc_str(mix_allocs).c_str(),ru.ru_maxrss/1024);
+    return 0;
+}
+
+// self checks
+// `fmus --selftest` runs the parts that have a known right answer without
+// a terminal or a sound card, prints every check that fails and exits
+// non-zero if any did. files go under a fresh directory in /tmp
+static int st_failed=0;
+#define ST_CHECK(c) do{ if(!(c)){ \
+    fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#c); ++st_failed; } }while(0)
+
+// index: store/load round trip, in-place patches, carrying over a stale one
+static void selftest_index(const fs::path &tmp){
+    fs::path dir=tmp/"idx";
+    fs::create_directories(dir);
+    string longname(200,'n');
+    vector<string> names={ "sub", "a.mp3", "b.flac", longname+".ogg" };
+    fs::create_directory(dir/"sub");
+    for(size_t i=1;i<names.size();++i) ofstream(dir/names[i])<<names[i];
+    uint32_t d=path_id(dir.native());
+    vector<Entry> v;
+    for(const string &n:names){
+        v.push_back(make_entry(path_child(d,n),n=="sub"?fs::file_type::directory:fs::file_type::regular));
+        if(v.back().dir()) continue;
+        Entry &x=v.back();
+        x.title="t "+n; x.artist="ar"; x.album=""; x.track=v.size(); x.year=1999;
+        x.dur_ms=1000*v.size(); x.meta=true; x.added=1234;
+        file_stamp(x.path(),x.mtime_ns,x.size);
+    }
+    v[2].gain_db=-6.5f; v[2].peak=0.9f;
+    int64_t mt=dir_mtime(dir);
+    index_store(dir,mt,v);
+
+    vector<Entry> w;
+    ST_CHECK(index_load(dir,mt,w));
+    ST_CHECK(w.size()==v.size());
+    for(size_t i=0;i<min(v.size(),w.size());++i){
+        ST_CHECK(w[i].id==v[i].id&&w[i].type==v[i].type);
+        ST_CHECK(w[i].title==v[i].title&&w[i].artist==v[i].artist&&w[i].album==v[i].album);
+        ST_CHECK(w[i].dur_ms==v[i].dur_ms&&w[i].track==v[i].track&&w[i].year==v[i].year);
+        ST_CHECK(w[i].mtime_ns==v[i].mtime_ns&&w[i].size==v[i].size&&w[i].added==v[i].added);
+        ST_CHECK(isnan(w[i].gain_db)==isnan(v[i].gain_db));
+    }
+    ST_CHECK(!index_load(dir,mt+1,w));         // directory moved on
+
+    // patches land on the right entry, the long name included
+    fs::path lt=dir/(longname+".ogg");
+    index_note_duration(lt,4321);
+    index_note_gain(lt,-3.f,0.5f);
+    float g=0,p=0;
+    ST_CHECK(index_gain(lt,g,p)&&g==-3.f&&p==0.5f);
+    ST_CHECK(index_gain(dir/"b.flac",g,p)&&g==-6.5f);
+    ST_CHECK(!index_gain(dir/"a.mp3",g,p));
+    ST_CHECK(index_load(dir,mt,w)&&w.size()==4&&w[3].dur_ms==4321&&w[1].dur_ms==2000);
+
+    // a changed file loses its values, the others keep them
+    ofstream(dir/"a.mp3",ios::app)<<"more";
+    vector<Entry> f=v;
+    for(Entry &x:f){ x.title.clear(); x.dur_ms=-1; x.meta=false; x.mtime_ns=0; x.size=0; }
+    ST_CHECK(index_carry(dir,f)==2);
+    ST_CHECK(f[1].title.empty()&&f[1].dur_ms==-1);
+    ST_CHECK(f[2].title=="t b.flac"&&f[2].gain_db==-6.5f);
+    ST_CHECK(f[3].dur_ms==4321);
+}
+
+// seek index builders on synthetic streams, and the mp3 walker only
+// running on what is mp3
+static void selftest_seek(const fs::path &tmp){
+    auto scan=[&](const fs::path &f,const string &data,auto &&body){
+        ofstream(f,ios::binary)<<data;
+        int fd=open(f.c_str(),O_RDONLY|O_CLOEXEC);
+        FileScan fs_{fd};
+        body(fs_);
+        close(fd);
+    };
+    // mp3: an ID3 tag, a Xing frame, then 100 MPEG-1 layer III frames at
+    // 128 kbit/s 44.1 kHz: 417 bytes, 1152 samples each
+    string id3("ID3\x04\0\0\0\0\0\x20",10);
+    id3.append(32,'\0');
+    string frame("\xff\xfb\x90\0",4);
+    frame.append(417-4,'\0');
+    string xing=frame;
+    memcpy(&xing[36],"Xing",4);
+    string mp3=id3+xing;
+    for(int i=0;i<100;++i) mp3+=frame;
+    scan(tmp/"t.mp3",mp3,[&](FileScan &fs_){
+        SeekIndex x;
+        ST_CHECK(seek_is_mp3(tmp/"t.mp3",fs_));
+        ST_CHECK(seek_build_mp3(fs_,x));
+        ST_CHECK(x.rate==44100&&x.samples==100*1152&&x.head_len==0);
+        // one point a second: frames 0, 39, 77
+        ST_CHECK(x.pts.size()==3);
+        for(size_t i=0;i<x.pts.size();++i){
+            uint64_t fr=(i*44100+1151)/1152;
+            ST_CHECK(x.pts[i].sample==fr*1152&&x.pts[i].offset==42+417+fr*417);
+        }
+    });
+    // the same frames without the extension still pass the sniff, a WAV
+    // full of look-alikes doesn't
+    scan(tmp/"t.bin",mp3.substr(42),[&](FileScan &fs_){ ST_CHECK(seek_is_mp3(tmp/"t.bin",fs_)); });
+    string wav("RIFF\0\0\0\0WAVEfmt ",16);
+    for(int i=0;i<64;++i) wav+=frame;
+    scan(tmp/"t.wav",wav,[&](FileScan &fs_){
+        SeekIndex x;
+        ST_CHECK(!seek_is_mp3(tmp/"t.wav",fs_));
+        ST_CHECK(!seek_build_flac(fs_,x));
+    });
+
+    // flac: STREAMINFO at 44.1 kHz with 4096-sample blocks, then 40 frames
+    // numbered in the header, each with its CRC-8
+    string fl("fLaC\x80\0\0\x22",8);
+    string si(34,'\0');
+    si[0]=0x10; si[2]=0x10;                         // block size 4096
+    si[10]=char(44100>>12); si[11]=char(44100>>4&0xff); si[12]=char((44100&0xf)<<4|0x02);
+    si[17]=char(40*4096&0xff); si[16]=char(40*4096>>8&0xff); si[15]=char(40*4096>>16);
+    fl+=si;
+    size_t head=fl.size();
+    for(int i=0;i<40;++i){
+        string f("\xff\xf8\xc9\x18",4);
+        f+=char(i);
+        f+=char(crc8((const uint8_t*)f.data(),5));
+        f.append(200-6,'\0');
+        fl+=f;
+    }
+    scan(tmp/"t.flac",fl,[&](FileScan &fs_){
+        SeekIndex x;
+        ST_CHECK(seek_build_flac(fs_,x));
+        ST_CHECK(x.rate==44100&&x.samples==40*4096&&x.head_len==head);
+        // a point at the first frame of each second
+        ST_CHECK(x.pts.size()==4);
+        for(size_t i=0;i<x.pts.size();++i){
+            uint64_t fr=(i*44100+4095)/4096;
+            ST_CHECK(x.pts[i].sample==fr*4096&&x.pts[i].offset==head+fr*200);
+        }
+    });
+}
+
+// eq: which bands make it into the cascade, and the gain the cascade has
+// at a band's centre and far away from it, both channels
+static void selftest_eq(){
+    auto design=[](int rate,double pre,initializer_list<pair<int,float>> bands){
+        Cmd c{ Cmd::EQ, {}, 1, pre };
+        for(auto [i,db]:bands) c.eq[i]=db;
+        return unique_ptr<EqStage>(eq_design(c,rate));
+    };
+    // dB of a sine at hz through e, from the second half of one second
+    auto gain_db=[](EqStage &e,int rate,double hz,int ch){
+        EqStage s=e;
+        vector<float> x(size_t(rate)*2);
+        for(int i=0;i<rate;++i) x[2*i]=x[2*i+1]=float(sin(2*M_PI*hz*i/rate));
+        for(int k=0;k<s.n;++k) eq_pair(s.p[k],x.data(),rate);
+        double in=0, out=0;
+        for(int i=rate/2;i<rate;++i){
+            double v=sin(2*M_PI*hz*i/rate);
+            in+=v*v; out+=double(x[2*i+ch])*x[2*i+ch];
+        }
+        return 10*log10(out/in);
+    };
+    auto near=[](double a,double b,double tol){ return fabs(a-b)<=tol; };
+
+    Cmd off{ Cmd::EQ, {}, 0, 6 };
+    ST_CHECK(unique_ptr<EqStage>(eq_design(off,48000))->n==0);
+    ST_CHECK(design(48000,0,{})->n==0);
+    ST_CHECK(design(48000,0,{ { 3, 0.01f } })->n==0);       // below 0.05 dB
+    ST_CHECK(design(32000,0,{ { 9, 6 } })->n==0);           // 16 kHz past 0.45 fs
+
+    auto pre=design(48000,-6,{});
+    ST_CHECK(pre->n==1);
+    ST_CHECK(near(gain_db(*pre,48000,440,0),-6,0.05));
+
+    auto one=design(48000,0,{ { 5, 12 } });
+    ST_CHECK(one->n==1);
+    for(int ch=0;ch<2;++ch){
+        ST_CHECK(near(gain_db(*one,48000,1000,ch),12,0.2));
+        ST_CHECK(near(gain_db(*one,48000,40,ch),0,0.5));
+        ST_CHECK(near(gain_db(*one,48000,15000,ch),0,0.5));
+    }
+
+    // three bands and a preamp fill two pairs, the preamp rides on the first
+    auto three=design(44100,-3,{ { 1, -6 }, { 5, 6 }, { 8, 6 } });
+    ST_CHECK(three->n==2);
+    for(int ch=0;ch<2;++ch){
+        ST_CHECK(near(gain_db(*three,44100,62,ch),-9,1));
+        ST_CHECK(near(gain_db(*three,44100,1000,ch),3,1));
+        ST_CHECK(near(gain_db(*three,44100,8000,ch),3,1));
+        ST_CHECK(near(gain_db(*three,44100,250,ch),-3,1));
+    }
+}
+
+// triple buffer: the consumer only ever sees whole blocks, newest first,
+// each once, while the producer runs flat out on another thread
+static void selftest_triple(){
+    struct Blk { uint64_t a, b[64]; };
+    auto t=make_unique<Triple<Blk>>();
+    ST_CHECK(!t->take());
+    t->back_buf().a=1; t->publish();
+    t->back_buf().a=2; t->publish();        // overwrites 1, never taken
+    const Blk *x=t->take();
+    ST_CHECK(x&&x->a==2);
+    ST_CHECK(!t->take()&&t->taken());
+
+    const uint64_t N=200000;
+    atomic<bool> done{false};
+    thread prod([&]{
+        for(uint64_t n=3;n<N;++n){
+            Blk &w=t->back_buf();
+            w.a=n;
+            for(uint64_t &v:w.b) v=n;
+            t->publish();
+        }
+        done=true;
+    });
+    uint64_t last=2, torn=0, back=0, got=0;
+    while(true){
+        bool fin=done;
+        if(const Blk *r=t->take()){
+            ++got;
+            for(uint64_t v:r->b) torn+=v!=r->a;
+            back+=r->a<=last;
+            last=r->a;
+        } else if(fin) break;
+    }
+    prod.join();
+    ST_CHECK(got>0&&torn==0&&back==0);
+    ST_CHECK(last==N-1);
+}
+
+// library search: word-start and substring matches, and typing on giving
+// what a fresh search of the same text gives
+static void selftest_search(const fs::path &tmp){
+    fs::path dir=tmp/"lib";
+    fs::create_directories(dir);
+    const char *rows[][3]={ { "Love Me Do", "Beatles", "Please" },
+                            { "Glove Box", "Overtone", "Pockets" },
+                            { "Dove", "Bird", "Feathers" },
+                            { "Ovation", "Band", "Clap" } };
+    uint32_t d=path_id(dir.native());
+    vector<Entry> v;
+    for(int i=0;i<4;++i){
+        string n="s"+to_string(i)+".mp3";
+        ofstream(dir/n)<<n;
+        v.push_back(make_entry(path_child(d,n),fs::file_type::regular));
+        v.back().title=rows[i][0]; v.back().artist=rows[i][1]; v.back().album=rows[i][2];
+        v.back().meta=true;
+    }
+    index_store(dir,dir_mtime(dir),v);
+    vector<fs::path> stale;
+    shared_ptr<const Library> L=lib_build(stale);
+
+    // titles of this directory's matches, in artist order
+    auto titles=[&](const LibSearch &s){
+        string r;
+        for(uint32_t x:s.matched)
+            if(L->str(L->dir[x])==dir.native()) r+=string(L->str(L->title[x]))+";";
+        return r;
+    };
+    auto fresh=[&](const string &q){ LibSearch s; lib_search(s,L,q); return s; };
+    ST_CHECK(titles(fresh("ov"))=="Ovation;Glove Box;");       // word starts only
+    ST_CHECK(titles(fresh("ove"))=="Love Me Do;Dove;Glove Box;");
+    ST_CHECK(titles(fresh("dov bi"))=="Dove;");
+    ST_CHECK(titles(fresh("OVATION"))=="Ovation;");
+    ST_CHECK(fresh("").matched.empty()&&fresh("   ").matched.empty());
+
+    // typed a letter at a time, each step as good as starting over
+    for(string q:{ "glove b", "ove", "be ple", " ov", "  dove" }){
+        LibSearch s;
+        for(size_t i=0;i<=q.size();++i){
+            lib_search(s,L,q.substr(0,i));
+            LibSearch f=fresh(q.substr(0,i));
+            ST_CHECK(s.matched==f.matched);
+            ST_CHECK(s.hits==f.hits);
+        }
+    }
+}
+
+// growing queue: settled positions never move under appends, settling and
+// picking, and the lazy shuffle still draws every order equally often
+static void selftest_queue(){
+    bool shuf=settings.shuffle_default;
+    auto fill=[](int from,int to){
+        for(int i=from;i<to;++i) pl_append(path_id("/selftest/q/"+to_string(i)),1000);
+    };
+    auto sound=[]{
+        vector<int> o=order;
+        sort(o.begin(),o.end());
+        for(int j=0;j<(int)o.size();++j) if(o[j]!=j||pl_pos[order[j]]!=j) return false;
+        return pl_settled<=(int)order.size();
+    };
+
+    settings.shuffle_default=false;
+    pl_start(); fill(0,5);
+    pl_settle(3);
+    ST_CHECK(order==vector<int>({ 0, 1, 2, 3, 4 })&&pl_pick(4)==4);
+
+    settings.shuffle_default=true;
+    rng.seed(1);
+    pl_start(); fill(0,10);
+    ST_CHECK(pl_settled==0&&pl_total_ms==10000&&!pl_append(playlist[3],1000));
+    pl_settle(2);
+    ST_CHECK(pl_settled==3&&sound());
+    vector<int> head(order.begin(),order.begin()+3);
+    fill(10,15);
+    pl_settle(5);
+    ST_CHECK(sound()&&pl_settled==6&&equal(head.begin(),head.end(),order.begin()));
+    head.assign(order.begin(),order.begin()+6);
+    int t=order[12];
+    ST_CHECK(pl_pick(12)==6&&order[6]==t&&pl_settled==7);
+    ST_CHECK(pl_pick(1)==1&&sound()&&equal(head.begin(),head.end(),order.begin()));
+    pl_settle(100);
+    ST_CHECK(pl_settled==15&&sound()&&pl_total_ms==15000);
+
+    // the draws are uniform: all orders of three, and after a pick the
+    // orders of the other three, each about 1/6 of 30000 runs
+    for(int pick=0;pick<2;++pick){
+        map<vector<int>,int> seen;
+        for(int r=0;r<30000;++r){
+            pl_start(); fill(0,3+pick);
+            if(pick) pl_pick(3);
+            pl_settle(3);
+            ++seen[vector<int>(order.begin()+pick,order.end())];
+            ST_CHECK(!pick||order[0]==3);
+        }
+        ST_CHECK(seen.size()==6);
+        for(auto &[o,n]:seen) ST_CHECK(abs(n-5000)<400);
+    }
+    settings.shuffle_default=shuf;
+    pl_start();
+}
+
+static int selftest(){
+    char tmpl[]="/tmp/fmus-selftest.XXXXXX";
+    if(!mkdtemp(tmpl)){ perror("mkdtemp"); return 1; }
+    fs::path tmp=tmpl;
+    // indexes go under tmp too, before anything asks where the cache is
+    setenv("XDG_CACHE_HOME",(tmp/"cache").c_str(),1);
+    selftest_index(tmp);
+    selftest_seek(tmp);
+    selftest_eq();
+    selftest_triple();
+    selftest_search(tmp);
+    selftest_queue();
+    error_code ec;
+    fs::remove_all(tmp,ec);
+    printf("selftest: %s\n",st_failed?(to_string(st_failed)+" failed").c_str():"ok");
+    return st_failed?1:0;
+}
+
+// SIGWINCH goes through a self-pipe so a blocked poll() wakes up; the
+// previous (ncurses) handler still runs so getch() reports KEY_RESIZE
+static int winch_pipe[2] = { -1, -1 };
+static struct sigaction prev_winch;
+static void on_winch(int s){
+    int e = errno;
+    if (prev_winch.sa_handler != SIG_DFL && prev_winch.sa_handler != SIG_IGN)
+        prev_winch.sa_handler(s);
+    ssize_t r = write(winch_pipe[1], "w", 1); (void)r;
+    errno = e;
+}
+
+int main(int argc,char **argv){
+    setlocale(LC_ALL,"");
+    if(argc>1&&!strcmp(argv[1],"--selftest")) return selftest();
+    load_settings();
+    if(argc>1&&!strcmp(argv[1],"--render")){
+        vector<fs::path> tracks;
+        fs::path out;
+        for(int i=2;i<argc;++i){
+            if(!strcmp(argv[i],"--out")&&i+1<argc) out=argv[++i];
+            else render_expand(argv[i],tracks);
+        }
+        return render(tracks,out);
+    }
+    register_help(":help","Show help");
+    register_help(":settings","Open settings");
+    register_help(":q","Quit");
+    register_help(":scan","Scan library from current dir");
+    register_help(":lib","Library by artist/album, o changes the order");
+    register_help("/","Search the library, Enter plays the matches");
+    register_help("p","Play everything under the selected folder");
+
+    initscr(); cbreak(); noecho(); keypad(stdscr,TRUE);
+    curs_set(0); timeout(0); mousemask(ALL_MOUSE_EVENTS,nullptr);
+
+    // wait set: stdin, resize, track end, clock, scan progress, dir changes,
+    // listing batches, tags
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    scan.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int ino_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    list_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    tags.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int clock_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (pipe2(winch_pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+        struct sigaction sa{};
+        sa.sa_handler = on_winch;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGWINCH, &sa, &prev_winch);
+    }
+
+    SDL_Init(SDL_INIT_AUDIO);
+    pb_init(settings.output_profile, settings.buffer_ms);
+
+    fs::path cwd = settings.start_path.empty()
+                      ? fs::path(getenv("HOME"))
+                      : settings.start_path;
+    vector<Entry> items;
+    shared_ptr<ListJob> job;    // listing in flight, null when complete
+    shared_ptr<TreeJob> tree_job;   // tree queue still growing
+    // any other queue replaces it
+    auto tree_cancel = [&]() {
+        if (tree_job) tree_job->cancel = true;
+        tree_job.reset();
+    };
+    if (settings.scan_on_start && !settings.start_path.empty())
+        scan_start(settings.start_path);
+
+    int sel = 0, off = 0;
+
+    // library view (:lib): artist -> album -> track, or every track in one of
+    // the other orders. it keeps the store it was opened on, a rebuild that
+    // finishes meanwhile is picked up back at the top level
+    struct LibLevel {
+        int    level = 0;           // 0 artists, 1 albums, 2 tracks
+        size_t lo = 0, hi = 0;      // range of perm shown
+        vector<uint32_t> groups;    // levels 0/1: where each group starts
+        int    sel = 0, off = 0;    // list position to come back to
+    };
+    struct LibView {
+        shared_ptr<const Library> L;
+        vector<uint32_t> perm;      // every row, in the current order
+        LibLevel at;
+        vector<LibLevel> up;        // the levels above
+    } lv;
+    bool lib_on = false;
+    int  lib_sort = LIB_ARTIST;
+    shared_ptr<const Library> lib;  // newest store
+    shared_ptr<LibJob> lib_job;     // build in flight
+    int  br_sel = 0, br_off = 0;    // browser position while away
+    // search (/): results are shown as a flat library view; the view it was
+    // opened from comes back when it closes. the query is kept for next time
+    bool searching = false;
+    string squery;
+    LibSearch srch;
+    struct { bool lib_on; int sel, off; LibView view; } s_saved;
+    bool playing = false;
+    wstring cur_name;
+    uint32_t now_id = PATH_NONE;
+    int track_len = 0, volume = 100;
+    if (settings.initial_volume_mode==0)      volume = settings.last_volume;
+    else if (settings.initial_volume_mode>0) volume = settings.initial_volume_mode;
+    pb_volume(volume);
+    pb_normalize(settings.normalize);
+    pb_eq(eq_gains(), settings.eq_preamp);
+    pb_crossfade(settings.crossfade_ms, settings.crossfade_curve);
+    pb_tap(settings.spectrum);
+
+    bool cmd = false;
+    string cmdbuf;
+    update_size();
+
+    int load_fails = 0;
+    vector<int> pending_order;  // reshuffle waiting for its first track
+    auto track_info = [&](){
+        now_id = playlist[order[cur]];
+        cur_name = path_of(now_id).filename().wstring();
+        track_len = int(pb_duration());
+        if (track_len > 0) {
+            index_note_duration(path_of(now_id), int(pb_duration()*1000));
+            pl_set_dur(order[cur], int(pb_duration()*1000));
+        }
+    };
+    // what plays after cur under the repeat/shuffle rules, as a playlist
+    // index, -1 to stop. a reshuffle is prepared in pending_order and only
+    // applied once its first track actually starts
+    auto plan_next = [&]() -> int {
+        pending_order.clear();
+        if (order.empty()) return -1;
+        if (settings.repeat_mode_default==2 && cur>=0) return order[cur];
+        int n = cur + 1;
+        pl_settle(n);
+        if (n < (int)order.size()) return order[n];
+        if (settings.reshuffle_on_end) {
+            pending_order = order;
+            shuffle(pending_order.begin(), pending_order.end(), rng);
+            return pending_order[0];
+        }
+        if (settings.repeat_mode_default==1) return order[0];
+        return -1;
+    };
+    // keep the next prefetch_tracks of the queue warm, in play order
+    auto prefetch_plan = [&](int t){
+        vector<fs::path> v;
+        if (t >= 0 && cur >= 0 && settings.repeat_mode_default != 2) {
+            bool fresh = !pending_order.empty();    // reshuffle starts at 0
+            if (!fresh) pl_settle(pl_pos[t] + settings.prefetch_tracks - 1);
+            const vector<int> &o = fresh ? pending_order : order;
+            for (int i = fresh ? 0 : pl_pos[t], k = 0; k < settings.prefetch_tracks; ++i, ++k) {
+                if (i >= (int)o.size()) {
+                    if (settings.repeat_mode_default != 1 || o.empty()) break;
+                    i = 0;
+                }
+                if (o[i] == order[cur]) break;   // wrapped all the way round
+                v.push_back(path_of(playlist[o[i]]));
+            }
+        }
+        prefetch(std::move(v), uint64_t(settings.prefetch_mb) << 20);
+    };
+    // hand the planned successor to the gapless/crossfade decoder and the
+    // prefetcher
+    auto requeue = [&](){
+        int t = plan_next();
+        prefetch_plan(t);
+        if ((!settings.gapless && !settings.crossfade_ms) || t < 0) pb_queue({}, -1);
+        else                            pb_queue(path_of(playlist[t]), t);
+    };
+    auto playidx = [&](int i){
+        if (i<0 || i>=(int)order.size()) { pb_stop(); return; }
+        cur = pl_pick(i);
+        pending_order.clear();
+        // PB_STARTED fills in the rest once the engine has it open
+        pb_play(path_of(playlist[order[i]]), order[i]);
+        playing = true;
+        now_id = playlist[order[i]];
+        cur_name = path_of(now_id).filename().wstring();
+        track_len = 0;
+    };
+    // the engine opened a track or moved on to the queued one
+    auto on_started = [&](int token){
+        load_fails = 0;
+        if (!pending_order.empty() && token == pending_order[0]) {
+            order.swap(pending_order);
+            pending_order.clear();
+            reindex_order();
+        }
+        if (token < (int)pl_pos.size() && pl_pos[token] >= 0) cur = pl_pos[token];
+        if (cur < 0) return;
+        track_info();
+        requeue();
+    };
+    auto next = [&](){
+        // cur is -1 if the first queued track was deleted while playing
+        if (order.empty()) return;
+        int t = plan_next();
+        if (t < 0) { playing=false; pb_stop(); return; }
+        if (!pending_order.empty()) {
+            order.swap(pending_order);
+            pending_order.clear();
+            reindex_order();
+        }
+        playidx(pl_pos[t]);
+    };
+    // gone or unreadable: move on, but give up after one pass over the queue
+    auto on_failed = [&](){
+        playing = false;
+        if (++load_fails < (int)order.size()) next();
+    };
+    auto prev = [&](){
+        if (cur<0 || order.empty()) return;
+        if (settings.repeat_mode_default==2) {
+            playidx(cur);
+            return;
+        }
+        int p = cur - 1;
+        if (p < 0) {
+            if (settings.repeat_mode_default==1) p = order.size() - 1;
+            else return;
+        }
+        playidx(p);
+    };
+
+    // what is currently on the terminal, so a frame only writes the regions
+    // that actually changed instead of clear() + full repaint
+    struct Screen {
+        string head;            // top row, loading state
+        vector<string> list;    // composed list rows
+        int    fill = -1;       // progress bar cells filled
+        int    secs = -1;       // elapsed seconds shown
+        string line;            // name + status line
+        string bottom;          // volume + scan progress
+        vector<int> spec;       // spectrum column heights, eighths of a row
+        int    rows = 0, cols = 0;
+    } scr;
+    // spectrum pane rows between progress bar and status line, 0 = none
+    const int SPEC_ROWS = 4, SPEC_FPS = 30;
+    auto spec_rows = [&]() { return settings.spectrum && rows >= 12 ? SPEC_ROWS : 0; };
+    vector<float> spec_db;      // shown level per column, falls off slowly
+    // forget the cache, next draw repaints everything (modals, resize)
+    auto invalidate = [&]() {
+        scr = Screen{};
+        clear();
+    };
+
+    auto elapsed_now = [&]() -> int {
+        return max(0, min(track_len, int(pb_position())));
+    };
+    auto bar_fill = [&](int ie) {
+        return (cols && track_len > 0)
+            ? int((double)ie / track_len * cols + 0.5)
+            : 0;
+    };
+
+    // rows the list shows after the up entry
+    auto list_len = [&]() -> int {
+        if (!lib_on) return items.size();
+        if (!lv.L) return 0;
+        return lv.at.level < 2 ? lv.at.groups.size() : lv.at.hi - lv.at.lo;
+    };
+    // [first, end) of group i in perm
+    auto lib_span = [&](int i) {
+        size_t a = lv.at.groups[i];
+        size_t b = i+1 < (int)lv.at.groups.size() ? lv.at.groups[i+1] : lv.at.hi;
+        return pair<size_t,size_t>(a, b);
+    };
+    // top level of the newest store in the current order
+    auto lib_top = [&]() {
+        lv.L = lib;
+        lv.up.clear();
+        lv.at = LibLevel{};
+        lv.perm.clear();
+        sel = off = 0;
+        if (!lv.L) return;
+        lv.perm = lib_sorted(*lv.L, lib_sort);
+        lv.at.hi = lv.perm.size();
+        if (lib_sort == LIB_ARTIST) lv.at.groups = lib_groups(lv.L->artist, lv.perm, 0, lv.at.hi);
+        else lv.at.level = 2;
+    };
+    auto lib_toggle = [&]() {
+        if (lib_on) { lib_on = false; sel = br_sel; off = br_off; return; }
+        lib_on = true;
+        br_sel = sel; br_off = off;
+        if (!lib_job && (!lib || lib->gen != index_gen)) lib_job = lib_async();
+        lib_top();
+    };
+    // up entry: back one level, out of the view from the top
+    auto lib_up = [&]() {
+        if (lv.up.empty()) { lib_toggle(); return; }
+        lv.at = std::move(lv.up.back());
+        lv.up.pop_back();
+        sel = lv.at.sel; off = lv.at.off;
+        if (lv.up.empty() && lv.L != lib) {
+            int s = sel, o = off;
+            lib_top();
+            sel = min(s, list_len());
+            off = min(o, sel);
+        }
+    };
+    auto lib_enter = [&]() {
+        if (!lv.L) return;
+        const Library &L = *lv.L;
+        int i = sel - 1;
+        if (lv.at.level == 2) {
+            tree_cancel();
+            build_pl(L, lv.perm.data() + lv.at.lo, lv.at.hi - lv.at.lo, i);
+            playidx(cur);
+            return;
+        }
+        auto [a, b] = lib_span(i);
+        lv.at.sel = sel; lv.at.off = off;
+        LibLevel n;
+        n.level = lv.at.level + 1;
+        n.lo = a; n.hi = b;
+        if (n.level == 1) n.groups = lib_groups(L.album, lv.perm, a, b);
+        lv.up.push_back(std::move(lv.at));
+        lv.at = std::move(n);
+        sel = off = 0;
+    };
+    // one library row: name, right-hand column, and the path for a track
+    auto lib_row = [&](int i, string &name, string &ind, uint32_t &id) {
+        const Library &L = *lv.L;
+        if (lv.at.level < 2) {
+            auto [a, b] = lib_span(i);
+            uint32_t r = lv.perm[a];
+            if (lv.at.level == 0)
+                name = L.artist[r] ? string(L.str(L.artist[r])) : "Unknown Artist";
+            else {
+                name = L.album[r] ? string(L.str(L.album[r])) : "Unknown Album";
+                if (L.year[r]) name += " (" + to_string(L.year[r]) + ")";
+            }
+            long ms = 0;
+            for (size_t k = a; k < b; ++k) ms += max(0, L.dur_ms[lv.perm[k]]);
+            ind = to_string(b - a) + (b - a == 1 ? " track, " : " tracks, ") + fmt_time(ms / 1000);
+            return;
+        }
+        uint32_t r = lv.perm[lv.at.lo + i];
+        string t(L.str(L.title[r] ? L.title[r] : L.file[r]));
+        if (lib_sort == LIB_ARTIST && lv.up.size() == 2) {
+            char no[8] = "";
+            if (L.track[r]) snprintf(no, sizeof no, "%02d. ", L.track[r]);
+            name = no + t;
+        } else
+            name = L.artist[r] ? string(L.str(L.artist[r])) + " - " + t : t;
+        if (!searching && lib_sort == LIB_YEAR && L.year[r]) ind = to_string(L.year[r]) + " ";
+        if (!searching && lib_sort == LIB_ADDED && L.added[r]) {
+            char d[16];
+            time_t tt = L.added[r];
+            struct tm tm;
+            strftime(d, sizeof d, "%Y-%m-%d ", localtime_r(&tt, &tm));
+            ind = d;
+        }
+        if (L.dur_ms[r] > 0) ind += fmt_time(L.dur_ms[r] / 1000);
+        id = L.pid[r];
+    };
+
+    // run the query against the newest store and show the hits, best first
+    auto search_run = [&]() {
+        if (!lib) return;
+        lib_search(srch, lib, squery);
+        lv.L = lib;
+        lv.perm = srch.hits;
+        lv.up.clear();
+        lv.at = LibLevel{};
+        lv.at.level = 2;
+        lv.at.hi = lv.perm.size();
+        sel = lv.perm.empty() ? 0 : 1;
+        off = 0;
+    };
+    auto search_open = [&]() {
+        s_saved = { lib_on, sel, off, lv };
+        searching = true;
+        lib_on = true;
+        if (!lib_job && (!lib || lib->gen != index_gen)) lib_job = lib_async();
+        srch = LibSearch{};
+        search_run();
+    };
+    auto search_close = [&]() {
+        searching = false;
+        lib_on = s_saved.lib_on;
+        sel = s_saved.sel; off = s_saved.off;
+        lv = std::move(s_saved.view);
+        scr.bottom.clear();
+    };
+
+    auto draw_list = [&]() {
+        // Build a virtual list first entry dirup
+        int total = list_len() + 1;
+        int vh    = max(0, rows - 4 - spec_rows());
+        if (sel < off)          off = sel;
+        if (sel >= off + vh)    off = sel - vh + 1;
+        scr.list.resize(vh);
+
+        string head = job ? "loading " + cwd.string() + " ..." : "";
+        if (lib_on) {
+            head = lv.L ? "library by " + string(lib_sort_names[lib_sort]) + ", "
+                          + to_string(lv.L->size()) + " tracks" : "";
+            if (lib_job) head += lv.L ? ", updating ..." : "building library ...";
+        }
+        if (searching)
+            head = lib ? to_string(srch.hits.size()) + " matches" : "building library ...";
+        if (head != scr.head) {
+            scr.head = head;
+            move(0, 0); clrtoeol();
+            mvprintw(0, 0, "%s", head.c_str());
+        }
+
+        // current playing
+        uint32_t nowp = pb_loaded() ? now_id : PATH_NONE;
+
+        for (int i = 0; i < vh; ++i) {
+            int idx = i + off;
+            string icon, name, ind;
+
+            if (idx < total) {
+                bool hl = (idx == sel);
+                if (idx == 0) {
+                    // dirup
+                    icon = hl ? " > " : "   ";
+                    name = settings.icon_dirup;
+                } else if (lib_on) {
+                    uint32_t p = PATH_NONE;
+                    lib_row(idx - 1, name, ind, p);
+                    if (p != PATH_NONE && p == nowp)
+                        icon = hl ? settings.icon_nowplaying_sel
+                                  : settings.icon_nowplaying;
+                    else
+                        icon = hl ? " > " : "   ";
+                    int pos = p == PATH_NONE ? -1 : order_pos(p);
+                    if (pos >= 0)
+                        ind += (ind.empty() ? "" : " ") + string("[") + to_string(pos+1)
+                             + "/" + to_string(order.size()) + "]";
+                } else {
+                    // file/dir
+                    const Entry &e = items[idx - 1];
+                    if (e.id == nowp)
+                        icon = hl ? settings.icon_nowplaying_sel
+                                  : settings.icon_nowplaying;
+                    else
+                        icon = hl ? " > " : "   ";
+                    name = string(e.fname()) + (e.dir() ? "/" : "");
+                    if (!e.title.empty())
+                        name = e.artist.empty() ? e.title : e.artist + " - " + e.title;
+
+                    // length, track pos
+                    if (e.dur_ms > 0) ind = fmt_time(e.dur_ms / 1000);
+                    int pos = e.dir() ? -1 : order_pos(e.id);
+                    if (pos >= 0)
+                        ind += (ind.empty() ? "" : " ") + string("[") + to_string(pos+1)
+                             + "/" + to_string(order.size()) + "]";
+                }
+            }
+
+            string row = icon + '\0' + name + '\0' + ind;
+            if (row == scr.list[i]) continue;
+            scr.list[i] = row;
+
+            move(i+1, 0); clrtoeol();
+            if (idx >= total) continue;
+            //icon draw
+            mvprintw(i+1, 0, "%s  ", icon.c_str());
+            mvprintw(i+1, 5, "%s", name.c_str());
+            if (!ind.empty())
+                mvprintw(i+1, cols - ind.size(), "%s", ind.c_str());
+        }
+    };
+
+    // progress bar + status, only the cells/text that moved
+    auto draw_status = [&]() {
+        int ybar = rows - 3 - spec_rows();
+        if (!pb_loaded()) {
+            // nothing loaded: blank what the last track left there, once
+            if (scr.fill >= 0 || !scr.line.empty()) {
+                move(ybar, 0);    clrtoeol();
+                move(rows-2, 0);  clrtoeol();
+            }
+            scr.fill = scr.secs = -1;
+            scr.line.clear();
+            return;
+        }
+        int ie   = elapsed_now();
+        int fill = bar_fill(ie);
+        if (scr.fill < 0) {
+            for (int x = 0; x < cols; ++x)
+                mvaddch(ybar, x, x < fill ? ACS_CKBOARD : ' ');
+        } else {
+            for (int x = min(fill, scr.fill); x < max(fill, scr.fill); ++x)
+                mvaddch(ybar, x, x < fill ? ACS_CKBOARD : ' ');
+        }
+        scr.fill = fill;
+        scr.secs = ie;
+
+        string cur_t = fmt_time(ie),
+               tot_t = fmt_time(track_len),
+               mode  = "[" +
+                 string(settings.shuffle_default?"S":"-") +
+                 "|" +
+                 (settings.repeat_mode_default==0?"N":
+                  settings.repeat_mode_default==1?"D":"O")
+                 + "]";
+        string status = cur_t + "/" + tot_t + " " + mode;
+        if (!playing) status += " [pause]";
+
+        vector<char> buf(cur_name.size()*4+1);
+        wcstombs(buf.data(), cur_name.c_str(), buf.size());
+        string tname(buf.data());
+        int w = status.size(), av = cols - w - 1;
+        if ((int)tname.size() > av)
+            tname = tname.substr(0, max(0, av-3)) + "...";
+
+        string line = tname + '\0' + status;
+        if (line != scr.line) {
+            scr.line = line;
+            move(rows-2, 0); clrtoeol();
+            mvprintw(rows-2, 0, "%s", tname.c_str());
+            mvprintw(rows-2, cols - w, "%s", status.c_str());
+        }
+    };
+
+    // spectrum pane, one bar per column from -60 dB up, drawn in eighths of
+    // a row; only columns whose height changed are written. true if any was
+    auto draw_spectrum = [&]() -> bool {
+        int h = spec_rows();
+        if (!h) return false;
+        static const char *glyph[9] = { " ", "\u2581", "\u2582", "\u2583", "\u2584",
+                                        "\u2585", "\u2586", "\u2587", "\u2588" };
+        spec_db.resize(cols, -60.f);
+        scr.spec.resize(cols, -1);
+        vector<float> now(cols);
+        if (!pb_loaded()) fill(spec_db.begin(), spec_db.end(), -60.f);
+        else if (pb_spectrum(now.data(), cols))
+            for (int x = 0; x < cols; ++x)
+                spec_db[x] = max(now[x], spec_db[x] - 36.f/SPEC_FPS);  // 36 dB/s fall
+        bool any = false;
+        for (int x = 0; x < cols; ++x) {
+            int e = int(clamp((spec_db[x] + 60) / 60, 0.f, 1.f) * h * 8);
+            if (e == scr.spec[x]) continue;
+            scr.spec[x] = e;
+            any = true;
+            for (int r = 0; r < h; ++r)
+                mvaddstr(rows - 3 - r, x, glyph[clamp(e - r*8, 0, 8)]);
+        }
+        return any;
+    };
+
+    // bottom row: volume and queue length left, library scan progress right
+    auto draw_bottom = [&]() {
+        // the bottom row doubles as the ':' and '/' prompts
+        if (cmd) return;
+        if (searching) {
+            string line = "/" + squery;
+            if (line == scr.bottom) return;
+            scr.bottom = line;
+            move(rows-1, 0); clrtoeol();
+            mvprintw(rows-1, 0, "%s", line.c_str());
+            return;
+        }
+        string vol = pb_loaded() ? "Vol: " + to_string(volume) + "%" : "";
+        if (!order.empty()) {
+            vol += (vol.empty() ? "" : "  ") + to_string(order.size())
+                 + (order.size() == 1 ? " track, " : " tracks, ")
+                 + fmt_time(int(pl_total_ms / 1000)) + (pl_unknown ? "+" : "");
+        }
+        string sc;
+        if (const auto &sr = scan.run; sr && sr->active)
+            sc = "scan: " + to_string(sr->dirs) + " dirs, "
+               + to_string(sr->tracks) + " tracks";
+        else if (sr && sr->dirs)
+            sc = "library: " + to_string(sr->tracks) + " tracks";
+        string line = vol + '\0' + sc;
+        if (line == scr.bottom) return;
+        scr.bottom = line;
+        move(rows-1, 0); clrtoeol();
+        mvprintw(rows-1, 0, "%s", vol.c_str());
+        if ((int)sc.size() < cols - (int)vol.size() - 1)
+            mvprintw(rows-1, cols - sc.size(), "%s", sc.c_str());
+    };
+
+    auto draw = [&]() {
+        update_size();
+        if (rows != scr.rows || cols != scr.cols) {
+            invalidate();
+            scr.rows = rows; scr.cols = cols;
+        }
+        draw_list();
+        draw_status();
+        draw_spectrum();
+        draw_bottom();
+        refresh();
+    };
+
+    // called on every clock tick while playing; repaints only when a bar
+    // cell, the shown second or a spectrum column changes, which caps the
+    // redraw rate at whatever is actually visible
+    auto tick = [&]() {
+        bool dirty = draw_spectrum();
+        int ie = elapsed_now();
+        if (ie != scr.secs || bar_fill(ie) != scr.fill) { draw_status(); dirty = true; }
+        if (dirty) refresh();
+    };
+
+    // inotify on cwd and the playlist's directory, re-pointed whenever
+    // either changes
+    int wd_cwd = -1, wd_pl = -1;
+    fs::path w_cwd, w_pl;
+    auto rewatch = [&]() {
+        if (ino_fd < 0 || (cwd == w_cwd && pl_dir == w_pl)) return;
+        const uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                            | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+                            | IN_ONLYDIR;
+        if (wd_cwd >= 0) inotify_rm_watch(ino_fd, wd_cwd);
+        if (wd_pl >= 0 && wd_pl != wd_cwd) inotify_rm_watch(ino_fd, wd_pl);
+        w_cwd = cwd; w_pl = pl_dir;
+        wd_cwd = inotify_add_watch(ino_fd, cwd.c_str(), mask);
+        wd_pl  = pl_dir.empty() ? -1
+               : inotify_add_watch(ino_fd, pl_dir.c_str(), mask);
+    };
+    // apply one create/delete to the sorted items, keeping sel on the same row
+    auto items_apply = [&](const fs::path &p, bool dir, bool added) {
+        if (!dir && !is_audio(p)) return;
+        int &bs = lib_on ? br_sel : sel;    // the browser's, even while away
+        Entry e = make_entry(path_id(p.native()), dir ? fs::file_type::directory
+                                                      : fs::file_type::regular);
+        auto it = lower_bound(items.begin(), items.end(), e, entry_less);
+        int at = it - items.begin();
+        if (added) {
+            if (it != items.end() && it->id == e.id) return;
+            items.insert(it, std::move(e));
+            if (at < bs) ++bs;
+        } else {
+            if (it == items.end() || it->id != e.id) return;
+            items.erase(it);
+            if (at < bs-1 || (at == bs-1 && bs > (int)items.size())) --bs;
+        }
+    };
+    // switch the browser to d; entries arrive through on_listing()
+    uint32_t sel_keep = PATH_NONE;  // entry to put the selection back on
+    auto open_dir = [&](const fs::path &d) {
+        if (job) job->cancel = true;
+        cwd = d;
+        items.clear();
+        sel = off = 0;
+        sel_keep = PATH_NONE;
+        job = list_async(cwd);
+    };
+    // read cwd from disk again, the selection follows its entry
+    auto relist = [&]() {
+        int &bs = lib_on ? br_sel : sel;
+        int &bo = lib_on ? br_off : off;
+        sel_keep = bs > 0 ? items[bs-1].id : PATH_NONE;
+        if (job) job->cancel = true;
+        items.clear();
+        bs = bo = 0;
+        job = list_async(cwd);
+    };
+    // list the queue's directory again, on_pl_sync() applies the difference
+    shared_ptr<ListJob> pl_job;
+    auto pl_resync = [&]() {
+        if (pl_job) pl_job->cancel = true;
+        pl_job = pl_dir.empty() ? nullptr : list_async(pl_dir);
+    };
+    // merge a batch into the sorted items, keeping sel on the same entry
+    auto on_listing = [&]() {
+        if (!job) return;
+        vector<Entry> b;
+        bool done;
+        {
+            lock_guard<mutex> lk(job->m);
+            b.swap(job->batch);
+            done = job->done;
+        }
+        if (!b.empty()) {
+            int &bs = lib_on ? br_sel : sel;
+            uint32_t keep = bs > 0 ? items[bs-1].id : sel_keep;
+            // still-loading playlist dir: queue its tracks as they show up
+            if (pl_dir == cwd && !playlist.empty()) {
+                for (auto &e : b) if (!e.dir()) pl_insert(e.id);
+                requeue();
+            }
+            sort(b.begin(), b.end(), entry_less);
+            size_t mid = items.size();
+            move(b.begin(), b.end(), back_inserter(items));
+            inplace_merge(items.begin(), items.begin()+mid, items.end(), entry_less);
+            // inotify may have inserted some of these already
+            items.erase(unique(items.begin(), items.end(),
+                [](const Entry &x, const Entry &y){ return x.id == y.id; }),
+                items.end());
+            if (keep != PATH_NONE) {
+                for (int i = 0; i < (int)items.size(); ++i)
+                    if (items[i].id == keep) { bs = i+1; sel_keep = PATH_NONE; break; }
+            }
+        }
+        if (done) { job.reset(); sel_keep = PATH_NONE; }
+        draw();
+    };
+    auto on_pl_sync = [&]() {
+        if (!pl_job) return;
+        vector<Entry> b;
+        {
+            lock_guard<mutex> lk(pl_job->m);
+            if (!pl_job->done) return;
+            b.swap(pl_job->batch);
+        }
+        bool same = pl_job->dir == pl_dir;
+        pl_job.reset();
+        if (!same) return;
+        unordered_set<uint32_t> there;
+        for (auto &e : b) if (!e.dir()) { there.insert(e.id); pl_insert(e.id); }
+        vector<uint32_t> gone;
+        for (auto &[f, k] : pl_index) if (!there.count(f)) gone.push_back(f);
+        for (uint32_t f : gone) pl_remove(f);
+        requeue();
+        draw();
+    };
+    auto on_inotify = [&]() {
+        alignas(struct inotify_event) char buf[4096];
+        ssize_t len;
+        bool changed = false, pl_changed = false, lost_cwd = false, lost_pl = false;
+        while ((len = read(ino_fd, buf, sizeof buf)) > 0) {
+            for (char *q = buf; q < buf + len; ) {
+                auto *ev = (struct inotify_event*)q;
+                q += sizeof(struct inotify_event) + ev->len;
+                // the kernel dropped events, neither list can be trusted
+                if (ev->mask & IN_Q_OVERFLOW) { lost_cwd = lost_pl = true; continue; }
+                // a watched directory itself was deleted or moved away
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    if (ev->wd == wd_cwd) { lost_cwd = true; w_cwd.clear(); }
+                    if (ev->wd == wd_pl)  { lost_pl = true;  w_pl.clear(); }
+                    continue;
+                }
+                if (!ev->len) continue;
+                bool added = ev->mask & (IN_CREATE | IN_MOVED_TO);
+                bool dir   = ev->mask & IN_ISDIR;
+                if (ev->wd == wd_cwd) {
+                    items_apply(cwd / ev->name, dir, added);
+                    changed = true;
+                }
+                if (ev->wd == wd_pl && !dir) {
+                    fs::path f = pl_dir / ev->name;
+                    if (!is_audio(f)) continue;
+                    if (added) pl_insert(path_id(f.native()));
+                    else       pl_remove(path_id(f.native()));
+                    pl_changed = true;
+                }
+            }
+        }
+        if (lost_cwd) {
+            // the nearest directory that is still there
+            error_code ec;
+            fs::path d = cwd;
+            while (!fs::is_directory(d, ec) && d.has_relative_path()) d = d.parent_path();
+            if (d == cwd) relist();
+            else          open_dir(d);
+            changed = true;
+        }
+        if (lost_pl) pl_resync();
+        // once per read, a copy of 1000 files is one requeue
+        if (pl_changed) requeue();
+        if (changed || pl_changed) draw();
+    };
+    // queue the whole tree under d, playing as soon as its first tracks show up
+    auto tree_play = [&](const fs::path &d) {
+        tree_cancel();
+        pl_start();
+        // the old queue's successor and warm files belong to nothing now
+        pb_queue({}, -1);
+        prefetch({}, 0);
+        tree_job = tree_async(d);
+    };
+    auto on_tree = [&]() {
+        if (!tree_job) return;
+        vector<pair<uint32_t,int>> b;
+        bool done;
+        {
+            lock_guard<mutex> lk(tree_job->m);
+            b.swap(tree_job->batch);
+            done = tree_job->done;
+        }
+        if (done) tree_job.reset();
+        if (b.empty()) return;
+        vector<uint32_t> fresh;
+        for (auto [f, ms] : b) if (pl_append(f, ms)) fresh.push_back(f);
+        if (settings.normalize) gain_queue(fresh);
+        if (cur < 0) { pl_settle(0); playidx(0); }
+        else         requeue();
+        draw();
+    };
+    // a library build finished: the top level moves over to it right away,
+    // deeper ones when they're left
+    auto on_library = [&]() {
+        if (!lib_job || !lib_job->done) return;
+        lib = lib_job->lib;
+        lib_job.reset();
+        if (searching) search_run();
+        else if (lib_on && lv.up.empty()) {
+            int s = sel, o = off;
+            lib_top();
+            sel = min(s, list_len());
+            off = min(o, sel);
+        }
+        draw();
+    };
+    // tags read in the background: into the listing and the queue length
+    auto on_meta = [&]() {
+        for (auto &d : meta_results()) {
+            if (d->dir == cwd) {
+                for (Entry &e : items) {
+                    if (e.dir() || e.meta) continue;
+                    auto it = lower_bound(d->v.begin(), d->v.end(), e, entry_less);
+                    if (it == d->v.end() || it->id != e.id) continue;
+                    e.title = it->title; e.artist = it->artist; e.album = it->album;
+                    e.track = it->track; e.meta = true;
+                    if (e.dur_ms <= 0) e.dur_ms = it->dur_ms;
+                }
+            }
+            // library and tree queues span many directories
+            for (auto &e : d->v) {
+                auto it = pl_index.find(e.id);
+                if (it != pl_index.end() && pl_dur[it->second] <= 0)
+                    pl_set_dur(it->second, e.dur_ms);
+            }
+        }
+        draw();
+    };
+
+    // clock timer is armed only while a running clock is on screen, at one
+    // bar cell or one second, whichever comes first; the spectrum pane
+    // runs it at SPEC_FPS
+    double clock_period = 0;
+    auto arm_clock = [&]() {
+        double p = 0;
+        if (playing && pb_loaded()) {
+            p = 1.0;
+            if (track_len > 0 && cols > 0) p = min(p, (double)track_len / cols);
+            p = max(p, 0.05);
+            if (spec_rows()) p = 1.0 / SPEC_FPS;
+        }
+        if (p == clock_period) return;
+        clock_period = p;
+        struct itimerspec its{};
+        its.it_value.tv_sec  = time_t(p);
+        its.it_value.tv_nsec = long((p - time_t(p)) * 1e9);
+        its.it_interval = its.it_value;
+        timerfd_settime(clock_fd, 0, &its, nullptr);
+    };
+
+    // sleeps until a key, resize, track end or clock tick; everything but
+    // keys is handled here, keys are left for getch()
+    auto wait_events = [&]() {
+        arm_clock();
+        rewatch();
+        struct pollfd pf[8] = {
+            { STDIN_FILENO,  POLLIN, 0 },
+            { winch_pipe[0], POLLIN, 0 },
+            { done_fd,       POLLIN, 0 },
+            { clock_fd,      POLLIN, 0 },
+            { scan.fd,       POLLIN, 0 },
+            { ino_fd,        POLLIN, 0 },
+            { list_fd,       POLLIN, 0 },
+            { tags.fd,       POLLIN, 0 },
+        };
+        if (poll(pf, 8, -1) < 0) return;
+        char junk[64];
+        uint64_t n;
+        if (pf[1].revents & POLLIN)
+            while (read(winch_pipe[0], junk, sizeof junk) > 0) {}
+        // on track end
+        if ((pf[2].revents & POLLIN) && read(done_fd, &n, sizeof n) > 0) {
+            int tok;
+            PbEvent e;
+            while ((e = pb_event(tok)) != PB_NONE) {
+                if (e == PB_STARTED)     on_started(tok);
+                else if (e == PB_FAILED) on_failed();
+                // PB_ENDED: nothing was queued gaplessly after it
+                else                     next();
+            }
+            draw();
+        }
+        // clock/progress update if playing
+        if ((pf[3].revents & POLLIN) && read(clock_fd, &n, sizeof n) > 0) {
+            if (playing && pb_loaded()) tick();
+        }
+        if ((pf[4].revents & POLLIN) && read(scan.fd, &n, sizeof n) > 0) {
+            // a finished scan brings an open library view up to date
+            if (!(scan.run && scan.run->active) && lib_on && !lib_job && lib && lib->gen != index_gen) {
+                lib_job = lib_async();
+                draw_list();
+            }
+            draw_bottom(); refresh();
+        }
+        if (pf[5].revents & POLLIN) on_inotify();
+        if ((pf[6].revents & POLLIN) && read(list_fd, &n, sizeof n) > 0) {
+            on_listing();
+            on_library();
+            on_tree();
+            on_pl_sync();
+        }
+        if ((pf[7].revents & POLLIN) && read(tags.fd, &n, sizeof n) > 0)
+            on_meta();
+    };
+
+    open_dir(cwd);
+    draw();
+
+    while (true) {
+        int c = getch();
+        MEVENT me;
+        if (c == ERR) { wait_events(); continue; }
+
+        // dzk za nic gpt ssasz pałe huja dało
+if (!cmd && c == 9) {
+    timeout(-1);
+
+    bool was_normalize = settings.normalize;
+    if (settings_menu())
+        break;
+    if (settings.normalize && !was_normalize) gain_queue(playlist);
+
+    invalidate();
+    refresh();
+
+    timeout(0);
+    requeue();      // repeat/gapless may have changed
+    pb_output(settings.output_profile, settings.buffer_ms);
+    pb_normalize(settings.normalize);
+    pb_eq(eq_gains(), settings.eq_preamp);
+    pb_crossfade(settings.crossfade_ms, settings.crossfade_curve);
+    pb_tap(settings.spectrum);
+
+    draw();
+    continue;
+}
+
+
+
+
+
+        if (c == KEY_RESIZE) { draw(); continue; }
+
+        // cmd exit
         if (cmd) {
             if (c == 10) {
+                timeout(-1);
                 if (cmdbuf == "help")      modal_help();
                 else if (cmdbuf=="quit"|| cmdbuf=="q")  break;
-                else if (cmdbuf=="settings"||cmdbuf=="s") settings_menu();
-                cmd = false; cmdbuf.clear(); draw();
+                else if (cmdbuf=="settings"||cmdbuf=="s") {
+                    settings_menu();
+                    pb_output(settings.output_profile, settings.buffer_ms);
+                    pb_normalize(settings.normalize);
+                    pb_eq(eq_gains(), settings.eq_preamp);
+                    pb_crossfade(settings.crossfade_ms, settings.crossfade_curve);
+                    pb_tap(settings.spectrum);
+                }
+                else if (cmdbuf=="scan") scan_start(cwd);
+                else if (cmdbuf=="lib")  lib_toggle();
+                timeout(0);
+                cmd = false; cmdbuf.clear(); invalidate(); draw();
             }
-            else if (c == 27) { cmd = false; cmdbuf.clear(); draw(); }
+            else if (c == 27) { cmd = false; cmdbuf.clear(); scr.bottom.clear(); draw(); }
             else if (c >= 32 && c < 127) {
                 cmdbuf.push_back((char)c);
                 mvprintw(rows-1,1,"%s",cmdbuf.c_str());
@@ -511,9 +5368,37 @@ if (!cmd && c == 9) {
             }
             continue;
         }
+        // search prompt: typing filters, arrows move, Enter plays the
+        // hits from the selected one, Esc goes back
+        if (searching) {
+            if (c == 3) break;
+            if (c == 27) search_close();
+            else if (c == KEY_UP)   sel = (sel-1+list_len()+1) % (list_len()+1);
+            else if (c == KEY_DOWN) sel = (sel+1) % (list_len()+1);
+            else if (c == 10) {
+                if (sel > 0 && lv.L) {
+                    tree_cancel();
+                    build_pl(*lv.L, lv.perm.data(), lv.perm.size(), sel-1);
+                    playidx(cur);
+                }
+                search_close();
+            }
+            else if (c == KEY_BACKSPACE || c == 127 || c == 8) {
+                if (!squery.empty()) { squery.pop_back(); search_run(); }
+            }
+            else if (c >= 32 && c < 256) { squery.push_back((char)c); search_run(); }
+            draw();
+            continue;
+        }
+        if (c == '/') {
+            search_open();
+            draw();
+            continue;
+        }
         if (c == ':') {
             cmd = true; cmdbuf.clear();
             mvprintw(rows-1,0,":"); clrtoeol(); refresh();
+            scr.bottom.clear();
             continue;
         }
 
@@ -521,7 +5406,7 @@ if (!cmd && c == 9) {
         if (c==KEY_MOUSE && getmouse(&me)==OK) {
             if (me.bstate & BUTTON4_PRESSED) volume=min(100,volume+5);
             if (me.bstate & BUTTON5_PRESSED) volume=max(0,volume-5);
-            Mix_VolumeMusic(volume*MIX_MAX_VOLUME/100);
+            pb_volume(volume);
             settings.last_volume = volume;
             draw(); continue;
         }
@@ -531,37 +5416,39 @@ if (!cmd && c == 9) {
         else if (c=='-') volume=max(0,volume-5);
         else if (c=='_') volume=max(0,volume-1);
         if (c=='='||c=='+'||c=='-'||c=='_') {
-            Mix_VolumeMusic(volume*MIX_MAX_VOLUME/100);
+            pb_volume(volume);
             settings.last_volume = volume;
             draw(); continue;
         }
 
         // navigation
-        if      (c==KEY_UP)   { sel=(sel-1+items.size()+1)%(items.size()+1); draw(); }
-        else if (c==KEY_DOWN) { sel=(sel+1)%(items.size()+1); draw(); }
+        if      (c==KEY_UP)   { sel=(sel-1+list_len()+1)%(list_len()+1); draw(); }
+        else if (c==KEY_DOWN) { sel=(sel+1)%(list_len()+1); draw(); }
+        else if (c==10 && lib_on) {
+            if (sel==0) lib_up();
+            else        lib_enter();
+            draw();
+        }
         else if (c==10) {
             if (sel==0) {
-                if (cwd.has_parent_path()) cwd=cwd.parent_path();
-                items = list_items(cwd);
-                sel = off = 0;
+                open_dir(cwd.has_parent_path() ? cwd.parent_path() : cwd);
             } else {
-                fs::path t = items[sel-1];
-                if (fs::is_directory(t)) {
-                    cwd=t; items=list_items(cwd);
-                    sel=off=0;
+                const Entry &t = items[sel-1];
+                if (t.dir()) {
+                    open_dir(t.path());
                 } else {
-                    build_pl(t); playidx(cur);
+                    tree_cancel();
+                    build_pl(t.id, items); playidx(cur);
                 }
             }
             draw();
         }
         // play/pause
-        else if (c==' ' && music) {
+        else if (c==' ' && pb_loaded()) {
             if (playing) {
-                Mix_PauseMusic(); playing=false;
+                pb_pause(true); playing=false;
             } else {
-                Mix_ResumeMusic(); playing=true;
-                set_time(Mix_GetMusicPosition(music));
+                pb_pause(false); playing=true;
             }
             draw();
         }
@@ -572,78 +5459,238 @@ if (!cmd && c == 9) {
         else if (c=='X') { if(!order.empty()) playidx(order.size()-1); draw(); }
 
         // scrub
-        else if ((c==KEY_LEFT||c==KEY_SLEFT) && music) {
+        else if ((c==KEY_LEFT||c==KEY_SLEFT) && pb_loaded()) {
             double d = (c==KEY_LEFT?1:5);
-            double p = Mix_GetMusicPosition(music) - d;
+            double p = pb_position() - d;
             if (p<0) p=0;
-            Mix_SetMusicPosition(p); set_time(p); draw();
+            pb_seek(p); draw();
         }
-        else if ((c==KEY_RIGHT||c==KEY_SRIGHT) && music) {
+        else if ((c==KEY_RIGHT||c==KEY_SRIGHT) && pb_loaded()) {
             double d = (c==KEY_RIGHT?1:5);
-            double p = Mix_GetMusicPosition(music) + d;
+            double p = pb_position() + d;
             if (p>track_len) p=track_len;
-            Mix_SetMusicPosition(p); set_time(p); draw();
+            pb_seek(p); draw();
         }
 
         // shuffle / repeat
         else if (c=='s') {
             settings.shuffle_default = !settings.shuffle_default;
-            if (music && cur>=0) build_pl(playlist[order[cur]]);
+            if (pb_loaded()) { pl_reorder(now_id); requeue(); }
             draw();
         }
         else if (c=='r') {
             settings.repeat_mode_default = (settings.repeat_mode_default+1)%3;
+            requeue();
+            draw();
+        }
+        // queue a folder tree
+        else if (c=='p' && !lib_on && sel>0 && items[sel-1].dir()) {
+            tree_play(items[sel-1].path());
+            draw();
+        }
+        // library order
+        else if (c=='o' && lib_on) {
+            lib_sort = (lib_sort+1) % LIB_SORTS;
+            lib_top();
             draw();
         }
 
         // quit Ctrl-C
         else if (c==3) break;
-
-        // on track end
-        if (done_cb) {
-            done_cb = false;
-            if (!Mix_PlayingMusic()) {
-                next(); draw();
-            }
-        }
-
-        // continuous redraw if playing
-        if (playing && music) draw();
     }
 
-    if (music) Mix_FreeMusic(music);
-    Mix_CloseAudio();
+    scan_stop();
+    prefetch_stop();
+    gain_stop();
+    meta_stop();
+    pb_shutdown();
     endwin();
     SDL_Quit();
+    close(done_fd); close(clock_fd); close(scan.fd); close(ino_fd);
+    close(tags.fd);
     save_settings();
     return 0;
 }
 
 
+// the queue's running total: add (+1) or take out (-1) playlist index k
+static void pl_count(int k,int sign){
+    if(pl_dur[k]>0) pl_total_ms+=sign*long(pl_dur[k]);
+    else            pl_unknown+=sign;
+}
+// from scratch, after the queue was rebuilt
+static void pl_retotal(){
+    pl_total_ms=0; pl_unknown=0;
+    for(int o:order) pl_count(o,1);
+}
+// a duration became known, keeps the total straight for queued tracks
+void pl_set_dur(int k,int ms){
+    bool queued=pl_pos[k]>=0;
+    if(queued) pl_count(k,-1);
+    pl_dur[k]=ms;
+    if(queued) pl_count(k,1);
+}
+
 // build plist
 void build_pl(const fs::path &f){
-    playlist.clear(); order.clear(); cur=-1;
     auto parent=f.parent_path();
-    if(!fs::exists(parent)||!fs::is_directory(parent)) return;
-    static const vector<string> exts={".mp3",".wav",".flac",".ogg",".aac",".m4a",".wma",".alac",".aiff",".opus"};
-    for(auto&e:fs::directory_iterator(parent)){
-        if(!e.is_directory()){
-            string ext=e.path().extension().string();
-            transform(ext.begin(),ext.end(),ext.begin(),::tolower);
-            if(find(exts.begin(),exts.end(),ext)!=exts.end())
-                playlist.push_back(e.path());
-        }
-    }
-    sort(playlist.begin(),playlist.end(),[](auto&a,auto&b){ return a.filename().wstring()<b.filename().wstring(); });
+    vector<Entry> v;
+    if(fs::exists(parent)&&fs::is_directory(parent)) v=list_items(parent);
+    build_pl(path_id(f.native()),v);
+}
+// from a listing of f's directory that's already in memory, no I/O
+void build_pl(uint32_t f,const vector<Entry> &listing){
+    playlist.clear(); order.clear(); cur=-1;
+    pl_pos.clear(); pl_index.clear(); pl_dur.clear();
+    pl_dir=path_of(path_parent(f));
+    // listings are already filtered and sorted by name, dirs first
+    for(auto&e:listing)
+        if(!e.dir()){ playlist.push_back(e.id); pl_dur.push_back(e.dur_ms); }
     order.resize(playlist.size());
     iota(order.begin(),order.end(),0);
     if(settings.shuffle_default&&order.size()>1)
         shuffle(order.begin(),order.end(),rng);
-    for(int i=0;i<(int)playlist.size();++i){
-        if(playlist[i]==f){
-            for(int j=0;j<(int)order.size();++j){
-                if(order[j]==i){ cur=j; return; }
-            }
-        }
+    pl_index.reserve(playlist.size());
+    for(int i=0;i<(int)playlist.size();++i)
+        pl_index.emplace(playlist[i],i);
+    reindex_order();
+    pl_retotal();
+    pl_settled=order.size();
+    cur=order_pos(f);
+    if(settings.normalize) gain_queue(playlist);
+}
+
+// from library rows, in the view's order; a queue without a directory
+void build_pl(const Library &L,const uint32_t *rows,size_t n,size_t at){
+    playlist.clear(); order.clear(); cur=-1;
+    pl_pos.clear(); pl_index.clear(); pl_dur.clear();
+    pl_dir.clear();
+    playlist.reserve(n); pl_dur.reserve(n);
+    for(size_t i=0;i<n;++i){
+        uint32_t r=rows[i];
+        playlist.push_back(L.pid[r]);
+        pl_dur.push_back(L.dur_ms[r]);
+    }
+    order.resize(n);
+    iota(order.begin(),order.end(),0);
+    if(settings.shuffle_default&&n>1)
+        shuffle(order.begin(),order.end(),rng);
+    pl_index.reserve(n);
+    for(int i=0;i<(int)n;++i)
+        pl_index.emplace(playlist[i],i);
+    reindex_order();
+    pl_retotal();
+    pl_settled=order.size();
+    cur=at<n?pl_pos[at]:-1;
+    if(settings.normalize) gain_queue(playlist);
+}
+
+// a queue that grows while it plays, see tree_async. tracks are appended
+// at the end and no position ever moves for them; under shuffle the order
+// from pl_settled on is only arrival order, and each position is drawn at
+// random from what's still unsettled just before it's needed (Fisher-Yates
+// run lazily), so the part the engine already queued stays put
+void pl_start(){
+    playlist.clear(); order.clear(); cur=-1;
+    pl_pos.clear(); pl_index.clear(); pl_dur.clear();
+    pl_dir.clear();
+    pl_total_ms=0; pl_unknown=0; pl_settled=0;
+}
+// fix the positions up to n
+void pl_settle(int n){
+    n=min(n,int(order.size())-1);
+    for(;pl_settled<=n;++pl_settled){
+        if(!settings.shuffle_default) continue;
+        int j=uniform_int_distribution<int>(pl_settled,order.size()-1)(rng);
+        swap(order[pl_settled],order[j]);
+        pl_pos[order[pl_settled]]=pl_settled; pl_pos[order[j]]=j;
+    }
+}
+// position i is played out of turn: an unsettled one becomes the next
+// settled position, returned
+int pl_pick(int i){
+    if(i<pl_settled||!settings.shuffle_default) return i;
+    int s=pl_settled++;
+    swap(order[s],order[i]);
+    pl_pos[order[s]]=s; pl_pos[order[i]]=i;
+    return s;
+}
+bool pl_append(uint32_t f,int dur_ms){
+    if(pl_index.count(f)) return false;
+    int k=playlist.size(), e=order.size();
+    playlist.push_back(f); pl_dur.push_back(dur_ms);
+    pl_index.emplace(f,k);
+    order.push_back(k); pl_pos.push_back(e);
+    pl_count(k,1);
+    return true;
+}
+
+// rebuild pl_pos, call after anything reorders `order`
+void reindex_order(){
+    pl_pos.assign(playlist.size(),-1);
+    for(int j=0;j<(int)order.size();++j) pl_pos[order[j]]=j;
+}
+
+// position of a path in order, -1 if it isn't queued
+int order_pos(uint32_t p){
+    auto it=pl_index.find(p);
+    return it==pl_index.end()?-1:pl_pos[it->second];
+}
+
+// live playlist updates (inotify). playlist indices never move: new files
+// are appended, removed ones stay behind as tombstones that are only dropped
+// from order and pl_index
+void pl_insert(uint32_t f){
+    if(pl_index.count(f)) return;
+    int k=playlist.size();
+    playlist.push_back(f);
+    pl_dur.push_back(-1);
+    pl_index.emplace(f,k);
+    int at;
+    if(settings.shuffle_default){
+        // somewhere in what's still to come
+        uniform_int_distribution<int> d(cur+1,order.size());
+        at=d(rng);
+    } else {
+        string_view key=path_name(f);
+        at=partition_point(order.begin(),order.end(),[&](int o){
+            return path_name(playlist[o])<key; })-order.begin();
     }
-}
\ No newline at end of file
+    order.insert(order.begin()+at,k);
+    if(at<=cur) ++cur;
+    if(at<pl_settled) ++pl_settled;
+    reindex_order();
+    pl_count(k,1);
+    if(settings.normalize) gain_queue({ f });
+}
+void pl_remove(uint32_t f){
+    auto it=pl_index.find(f);
+    if(it==pl_index.end()) return;
+    int k=it->second, at=pl_pos[k];
+    pl_index.erase(it);
+    if(at<0) return;
+    pl_count(k,-1);
+    order.erase(order.begin()+at);
+    if(at<pl_settled) --pl_settled;
+    // removing the playing track leaves cur just before its successor
+    if(at<=cur) --cur;
+    reindex_order();
+}
+
+// shuffle toggled: re-order what is queued without going back to disk
+void pl_reorder(uint32_t now){
+    order.clear();
+    for(int i=0;i<(int)playlist.size();++i)
+        // a file that came back has a newer index, its tombstone stays out
+        if(auto it=pl_index.find(playlist[i]);it!=pl_index.end()&&it->second==i)
+            order.push_back(i);
+    if(settings.shuffle_default)
+        shuffle(order.begin(),order.end(),rng);
+    else if(!pl_dir.empty())    // a library queue is already in view order
+        stable_sort(order.begin(),order.end(),[](int a,int b){
+            return path_name(playlist[a])<path_name(playlist[b]); });
+    reindex_order();
+    pl_retotal();
+    pl_settled=order.size();
+    cur=order_pos(now);
+}